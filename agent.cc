@@ -0,0 +1,524 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "agent.h"
+#include "misc.h"
+#include "sftp-internal.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <deque>
+#include <set>
+#include <thread>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** @brief Largest request packet accepted from a client */
+#define MAX_REQUEST 1048576
+
+namespace {
+
+/** @brief Append a uint32
+ * @param s Packet being constructed
+ * @param n Value to append
+ */
+void put32(std::string &s, uint32_t n) {
+  n = tobe32(n);
+  s.append((char *)&n, sizeof n);
+}
+
+/** @brief Append a uint64
+ * @param s Packet being constructed
+ * @param n Value to append
+ */
+void put64(std::string &s, uint64_t n) {
+  n = tobe64(n);
+  s.append((char *)&n, sizeof n);
+}
+
+/** @brief Append a string
+ * @param s Packet being constructed
+ * @param str Value to append
+ */
+void putstr(std::string &s, const std::string &str) {
+  put32(s, str.size());
+  s.append(str);
+}
+
+/** @brief Start a packet
+ * @param s Packet being constructed
+ * @param type Packet type
+ */
+void newpacket(std::string &s, uint8_t type) {
+  uint8_t header[5] = { 0, 0, 0, 0, type };
+  s.assign((char *)header, 5);
+}
+
+/** @brief Fill in the length of a packet
+ * @param s Packet being constructed
+ */
+void endpacket(std::string &s) {
+  uint32_t len = tobe32(s.size() - 4);
+  s.replace(0, sizeof len, (char *)&len, sizeof len);
+}
+
+/** @brief Unpack a uint32
+ * @param s Packet being parsed
+ * @param pos Position in packet
+ * @return Value unpacked
+ */
+uint32_t get32(const std::string &s, size_t &pos) {
+  uint32_t n;
+  if(s.size() < pos || s.size() - pos < sizeof n)
+    throw std::runtime_error("truncated packet");
+  memcpy(&n, &s[pos], sizeof n);
+  pos += sizeof n;
+  return frombe32(n);
+}
+
+/** @brief Unpack a string
+ * @param s Packet being parsed
+ * @param pos Position in packet
+ * @return Value unpacked
+ */
+std::string getstr(const std::string &s, size_t &pos) {
+  uint32_t len = get32(s, pos);
+  if(len > s.size() - pos)
+    throw std::runtime_error("truncated packet");
+  std::string r(s, pos, len);
+  pos += len;
+  return r;
+}
+
+/** @brief Read a packet
+ * @param fd File descriptor to read from
+ * @param packet Complete packet, including length
+ * @return @c true on success, @c false at EOF
+ */
+bool read_packet(int fd, std::string &packet) {
+  uint32_t len;
+  ssize_t n = readall(fd, (char *)&len, sizeof len);
+  if(n < 0)
+    syserror("agent: read");
+  if(n == 0)
+    return false;
+  if(n < (ssize_t)sizeof len)
+    throw std::runtime_error("agent: truncated packet");
+  len = frombe32(len);
+  if(len < 5 || len > MAX_REQUEST)
+    throw std::runtime_error("agent: bad packet length");
+  packet.resize(len + sizeof len);
+  endpacket(packet);
+  n = readall(fd, &packet[sizeof len], len);
+  if(n < 0)
+    syserror("agent: read");
+  if(n < len)
+    throw std::runtime_error("agent: truncated packet");
+  return true;
+}
+
+/** @brief A reply owed to a client */
+struct Pending {
+  /** @brief Request type */
+  int type;
+
+  /** @brief Client's ID for the request */
+  uint32_t client_id;
+
+  /** @brief Upstream ID for the request */
+  uint32_t upstream_id;
+
+  /** @brief Complete reply, if generated locally */
+  std::string reply;
+
+  /** @brief Set to mark the end of the client's requests */
+  bool end;
+};
+
+/** @brief One client's session with the agent */
+class Session {
+public:
+  /** @brief Construct a session
+   * @param fd Socket connected to the client
+   * @param conn Upstream connection
+   * @param home Home directory on upstream host
+   */
+  Session(int fd, std::shared_ptr<SFTP::Connection> conn,
+          const std::string &home) :
+    fd(fd), conn(conn), home(home) {}
+
+  /** @brief Handle requests until the client disconnects */
+  void run();
+
+private:
+  /** @brief Socket connected to client */
+  int fd;
+
+  /** @brief Upstream connection */
+  std::shared_ptr<SFTP::Connection> conn;
+
+  /** @brief Home directory */
+  std::string home;
+
+  /** @brief Lock protecting the fields below */
+  std::mutex lock;
+
+  /** @brief Signalled when @ref pending changes */
+  std::condition_variable cond;
+
+  /** @brief Replies owed to the client, in order */
+  std::deque<Pending> pending;
+
+  /** @brief Handles opened by the client and not yet closed */
+  std::set<std::string> handles;
+
+  /** @brief Set if the client can no longer be written to */
+  bool broken = false;
+
+  /** @brief Read requests from the client and forward them */
+  void reader();
+
+  /** @brief Collect replies and return them to the client */
+  void writer();
+
+  /** @brief Queue a reply
+   * @param p Reply to queue
+   */
+  void queue(Pending &&p);
+
+  /** @brief Construct a local reply to a request, if possible
+   * @param type Request type
+   * @param id Request ID
+   * @param packet Request packet
+   * @param reply Where to store the reply
+   * @return @c true if a local reply was generated
+   */
+  bool local_reply(int type, uint32_t id, const std::string &packet,
+                   std::string &reply);
+
+  /** @brief Send a reply to the client
+   * @param reply Reply packet
+   * @param data Data payload for @ref SSH_FXP_DATA
+   */
+  void send(std::string &reply, const Buffer *data = nullptr);
+};
+
+void Session::run() {
+  std::thread w(&Session::writer, this);
+  try {
+    reader();
+  } catch(std::runtime_error &e) {
+    if(debug)
+      fprintf(stderr, "DEBUG: agent: reader: %s\n", e.what());
+  }
+  queue(Pending{ 0, 0, 0, "", true });
+  w.join();
+  // Close anything the client left open
+  for(auto &handle : handles) {
+    try {
+      conn->close(handle);
+    } catch(std::runtime_error &e) {
+      // Ignore errors
+    }
+  }
+}
+
+void Session::reader() {
+  std::string packet;
+  while(read_packet(fd, packet)) {
+    size_t pos = 5;
+    int type = (uint8_t)packet[4];
+    uint32_t id = get32(packet, pos); // uint32 id
+    Pending p{ type, id, 0, "", false };
+    if(!local_reply(type, id, packet, p.reply)) {
+      if(type == SSH_FXP_CLOSE) {
+        std::string handle = getstr(packet, pos); // string handle
+        std::lock_guard<std::mutex> g(lock);
+        handles.erase(handle);
+      }
+      p.upstream_id = conn->forward(packet);
+    }
+    queue(std::move(p));
+  }
+}
+
+bool Session::local_reply(int type, uint32_t id, const std::string &packet,
+                          std::string &reply) {
+  size_t pos = 9;
+  switch(type) {
+  case SSH_FXP_REALPATH:
+    // Answer home directory lookups from the cache
+    if(getstr(packet, pos).size() == 0) {
+      newpacket(reply, SSH_FXP_NAME);
+      put32(reply, id);    // uint32 id
+      put32(reply, 1);     // uint32 count
+      putstr(reply, home); // string filename
+      putstr(reply, home); // string longname
+      put32(reply, 0);     // ATTRS attrs
+      endpacket(reply);
+      return true;
+    }
+    return false;
+  case SSH_FXP_EXTENDED:
+    // Answer limits queries from the connection
+    if(getstr(packet, pos) == "limits@openssh.com") {
+      newpacket(reply, SSH_FXP_EXTENDED_REPLY);
+      put32(reply, id);                             // uint32 id
+      put64(reply, conn->max_read_length() + 1024); // max-packet-length
+      put64(reply, conn->max_read_length());        // max-read-length
+      put64(reply, 0);                              // max-write-length
+      put64(reply, conn->max_open_handles());       // max-open-handles
+      endpacket(reply);
+      return true;
+    }
+    return false;
+  default: return false;
+  }
+}
+
+void Session::queue(Pending &&p) {
+  std::lock_guard<std::mutex> g(lock);
+  pending.push_back(std::move(p));
+  cond.notify_one();
+}
+
+void Session::writer() {
+  std::string body, reply;
+  Buffer data;
+  for(;;) {
+    Pending p;
+    {
+      std::unique_lock<std::mutex> locked(lock);
+      while(pending.size() == 0)
+        cond.wait(locked);
+      p = std::move(pending.front());
+      pending.pop_front();
+    }
+    if(p.end)
+      break;
+    if(p.reply.size() == 0) {
+      // Wait for the upstream reply
+      int type;
+      try {
+        type = conn->await_forwarded(p.upstream_id, body, data);
+      } catch(std::runtime_error &e) {
+        // Report the failure to the client
+        newpacket(p.reply, SSH_FXP_STATUS);
+        put32(p.reply, p.client_id);            // uint32 id
+        put32(p.reply, SSH_FX_CONNECTION_LOST); // uint32 error code
+        putstr(p.reply, e.what());              // string error message
+        putstr(p.reply, "");                    // string language tag
+        endpacket(p.reply);
+        send(p.reply);
+        continue;
+      }
+      // Track open handles
+      size_t pos = 4;
+      if(p.type == SSH_FXP_OPEN && type == SSH_FXP_HANDLE) {
+        std::lock_guard<std::mutex> g(lock);
+        handles.insert(getstr(body, pos));
+      }
+      // Substitute the client's ID
+      newpacket(reply, type);
+      put32(reply, p.client_id);
+      reply.append(body, 4, std::string::npos);
+      if(type == SSH_FXP_DATA) {
+        put32(reply, data.size());
+        uint32_t len = tobe32(reply.size() - 4 + data.size());
+        reply.replace(0, sizeof len, (char *)&len, sizeof len);
+        send(reply, &data);
+      } else {
+        endpacket(reply);
+        send(reply);
+      }
+      data.release();
+    } else
+      send(p.reply);
+  }
+}
+
+void Session::send(std::string &reply, const Buffer *data) {
+  if(broken)
+    return;
+  if(writeall(fd, &reply[0], reply.size()) < 0
+     || (data && writeall(fd, data->data(), data->size()) < 0)) {
+    if(debug)
+      fprintf(stderr, "DEBUG: agent: write: %s\n", strerror(errno));
+    // Keep collecting replies, but discard them
+    broken = true;
+  }
+}
+
+} // namespace
+
+Agent::Agent(const SFTP::Transport &transport_) : transport(transport_) {
+  // Our own connections must not use an agent
+  transport.agent = false;
+  // Clients know files by the server's handles, so they cannot survive a
+  // reconnect here; they reconnect to us instead.
+  transport.retries = 0;
+}
+
+Agent::~Agent() {
+  if(fd >= 0) {
+    ::close(fd);
+    unlink(path.c_str());
+  }
+}
+
+void Agent::listen() {
+  path = SFTP::Transport::agent_socket();
+  struct sockaddr_un addr;
+  if(path.size() >= sizeof addr.sun_path)
+    syserror(path, ENAMETOOLONG);
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+    syserror("socket");
+  close_on_exec(fd);
+  // See if there is an agent already
+  if(::connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+    ::close(fd);
+    fd = -1;
+    throw std::runtime_error(path + ": agent already running");
+  }
+  // Remove any stale socket
+  if(unlink(path.c_str()) < 0 && errno != ENOENT)
+    syserror(path);
+  ::close(fd);
+  if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+    syserror("socket");
+  close_on_exec(fd);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+    syserror(path);
+  if(::listen(fd, SOMAXCONN) < 0)
+    syserror(path);
+  if(debug)
+    fprintf(stderr, "DEBUG: agent: listening on %s\n", path.c_str());
+}
+
+void Agent::detach() {
+  switch(fork()) {
+  case -1: syserror("fork");
+  case 0: break;
+  default: _exit(0);
+  }
+  if(setsid() < 0)
+    syserror("setsid");
+  int null = ::open("/dev/null", O_RDWR);
+  if(null < 0)
+    syserror("/dev/null");
+  if(dup2(null, 0) < 0 || dup2(null, 1) < 0 || dup2(null, 2) < 0)
+    syserror("dup2");
+  if(null > 2)
+    ::close(null);
+  if(chdir("/") < 0)
+    syserror("chdir");
+}
+
+void Agent::run() {
+  for(;;) {
+    int client = accept(fd, nullptr, nullptr);
+    if(client < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+        continue;
+      syserror("accept");
+    }
+    close_on_exec(client);
+    std::thread(&Agent::serve, this, client).detach();
+  }
+}
+
+std::shared_ptr<SFTP::Connection>
+Agent::connection(const std::string &name, std::string &home) {
+  std::shared_ptr<Host> host;
+  {
+    std::lock_guard<std::mutex> g(lock);
+    std::shared_ptr<Host> &h = hosts[name];
+    if(!h)
+      h = std::make_shared<Host>();
+    host = h;
+  }
+  std::lock_guard<std::mutex> g(host->lock);
+  if(!host->conn || host->conn->failed()) {
+    // Existing clients may still be using a failed connection, so
+    // replace it rather than reconnecting it.
+    std::shared_ptr<SFTP::Connection> conn =
+      std::make_shared<SFTP::Connection>(name, transport);
+    conn->connect();
+    host->home = conn->realpath("");
+    host->conn = conn;
+  }
+  home = host->home;
+  return host->conn;
+}
+
+void Agent::serve(int client) {
+  try {
+    // Get the client's SSH_FXP_INIT, which names the host
+    std::string packet, name;
+    if(!read_packet(client, packet))
+      syserror("agent: unexpected EOF");
+    if(packet[4] != SSH_FXP_INIT)
+      throw std::runtime_error("agent: expected SSH_FXP_INIT");
+    size_t pos = 9; // skip uint32 version
+    while(pos < packet.size()) {
+      std::string ext = getstr(packet, pos);  // string extension-name
+      std::string data = getstr(packet, pos); // string extension-data
+      if(ext == AGENT_HOST_EXTENSION)
+        name = data;
+    }
+    if(name.size() == 0)
+      throw std::runtime_error("agent: no host specified");
+    if(debug)
+      fprintf(stderr, "DEBUG: agent: client for %s\n", name.c_str());
+    std::shared_ptr<SFTP::Connection> conn;
+    std::string home, reply;
+    try {
+      conn = connection(name, home);
+    } catch(std::runtime_error &e) {
+      // Tell the client what went wrong
+      newpacket(reply, SSH_FXP_STATUS);
+      put32(reply, 0);                    // uint32 id
+      put32(reply, SSH_FX_NO_CONNECTION); // uint32 error code
+      putstr(reply, e.what());            // string error message
+      putstr(reply, "");                  // string language tag
+      endpacket(reply);
+      writeall(client, &reply[0], reply.size());
+      throw;
+    }
+    // Tell the client about the server
+    newpacket(reply, SSH_FXP_VERSION);
+    put32(reply, 3); // uint32 version
+    for(auto &it : conn->extension_map()) {
+      putstr(reply, it.first);  // string extension-name
+      putstr(reply, it.second); // string extension-data
+    }
+    endpacket(reply);
+    if(writeall(client, &reply[0], reply.size()) < 0)
+      syserror("agent: write");
+    Session(client, conn, home).run();
+  } catch(std::runtime_error &e) {
+    if(debug)
+      fprintf(stderr, "DEBUG: agent: %s\n", e.what());
+  }
+  ::close(client);
+}
@@ -0,0 +1,114 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef AGENT_H
+#define AGENT_H
+/** @file agent.h
+ * @brief Connection-sharing agent
+ */
+
+#include <config.h>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "sftp.h"
+
+/** @brief Agent holding warm SFTP connections
+ *
+ * The agent listens on a Unix socket (see @ref
+ * SFTP::Transport::agent_socket). Clients speak SFTP to it, naming the
+ * host they want with @ref AGENT_HOST_EXTENSION in their @ref
+ * SSH_FXP_INIT packet. Their requests are forwarded over a connection to
+ * that host, which is kept open for future clients.
+ *
+ * The home directory and server limits are cached, so clients can
+ * discover them without a round trip to the server.
+ */
+class Agent {
+public:
+  /** @brief Construct an agent
+   * @param transport How to reach SFTP servers
+   */
+  Agent(const SFTP::Transport &transport);
+
+  /** @brief Destroy an agent */
+  ~Agent();
+
+  /** @brief Create the agent socket
+   *
+   * Raises an exception if an agent is already running.
+   */
+  void listen();
+
+  /** @brief Detach into the background */
+  void detach();
+
+  /** @brief Serve clients
+   *
+   * Never returns.
+   */
+  [[noreturn]] void run();
+
+private:
+  /** @brief A remote host */
+  struct Host {
+    /** @brief Lock protecting this host */
+    std::mutex lock;
+
+    /** @brief Connection to the host */
+    std::shared_ptr<SFTP::Connection> conn;
+
+    /** @brief Home directory on the host */
+    std::string home;
+  };
+
+  /** @brief How to reach SFTP servers */
+  SFTP::Transport transport;
+
+  /** @brief Path to listening socket */
+  std::string path;
+
+  /** @brief Listening socket */
+  int fd = -1;
+
+  /** @brief Lock protecting @ref hosts */
+  std::mutex lock;
+
+  /** @brief Known hosts */
+  std::map<std::string, std::shared_ptr<Host>> hosts;
+
+  /** @brief Get a working connection to a host
+   * @param name Hostname
+   * @param home Where to store home directory
+   * @return Connection
+   *
+   * If there is no connection, or the existing one has failed, a new one is
+   * created.
+   */
+  std::shared_ptr<SFTP::Connection> connection(const std::string &name,
+                                               std::string &home);
+
+  /** @brief Serve a single client
+   * @param client Socket connected to client
+   *
+   * This runs in a background thread. @p client will be closed.
+   */
+  void serve(int client);
+};
+
+#endif
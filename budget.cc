@@ -0,0 +1,46 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "budget.h"
+#include <mutex>
+
+namespace {
+
+/** @brief Lock protecting @ref limit and @ref used */
+std::mutex lock;
+
+/** @brief Process-wide budget, or 0 for no limit */
+size_t limit;
+
+/** @brief Total bytes held by all reservations */
+size_t used;
+
+} // namespace
+
+bool Reservation::resize(size_t bytes) {
+  std::lock_guard<std::mutex> g(lock);
+  if(bytes > held && limit && held > 0 && used + (bytes - held) > limit)
+    return false;
+  used = used + bytes - held;
+  held = bytes;
+  return true;
+}
+
+void Reservation::set_limit(size_t bytes) {
+  std::lock_guard<std::mutex> g(lock);
+  limit = bytes;
+}
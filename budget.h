@@ -0,0 +1,77 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BUDGET_H
+#define BUDGET_H
+/** @file budget.h
+ * @brief Process-wide memory budget
+ */
+
+#include <config.h>
+#include <cstddef>
+
+/** @brief A share of the process-wide budget for file data
+ *
+ * Feeders reserve memory for each read before issuing it, covering the
+ * read while it is in flight and its data until it has been handed to
+ * diff. When the budget (see @ref set_limit) is exhausted, reservations
+ * fail and the feeder must wait for some of its own data to drain.
+ *
+ * A reservation that currently holds nothing may always grow, even beyond
+ * the budget. This guarantees that every feeder can make progress one
+ * read at a time, so that feeders cannot deadlock waiting for each
+ * other's memory.
+ *
+ * A reservation is released when it is destroyed.
+ */
+class Reservation {
+public:
+  /** @brief Construct an empty reservation */
+  Reservation() = default;
+
+  Reservation(const Reservation &) = delete;
+  Reservation &operator=(const Reservation &) = delete;
+
+  /** @brief Destroy a reservation, returning its memory to the budget */
+  ~Reservation() {
+    resize(0);
+  }
+
+  /** @brief Change the size of the reservation
+   * @param bytes New size
+   * @return @c true on success, @c false if the budget is exhausted
+   *
+   * Shrinking always succeeds.
+   */
+  bool resize(size_t bytes);
+
+  /** @brief Return the size of the reservation */
+  size_t size() const {
+    return held;
+  }
+
+  /** @brief Set the process-wide budget
+   * @param bytes Budget in bytes, or 0 for no limit
+   */
+  static void set_limit(size_t bytes);
+
+private:
+  /** @brief Bytes held */
+  size_t held = 0;
+};
+
+#endif
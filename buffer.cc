@@ -0,0 +1,132 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "buffer.h"
+#include "misc.h"
+#include <cstdlib>
+#include <cassert>
+#include <mutex>
+#include <vector>
+
+/** @brief Smallest allocation, as a power of 2 */
+#define MIN_SHIFT 12
+
+/** @brief Number of size classes */
+#define CLASSES 40
+
+/** @brief Maximum memory retained in the pool */
+#define MAX_RETAINED (64 * 1024 * 1024)
+
+namespace {
+
+/** @brief Pool of free buffers
+ *
+ * Buffers are kept in power-of-2 size classes.
+ */
+struct Pool {
+  ~Pool() {
+    for(auto &l : free)
+      for(auto p : l)
+        ::free(p);
+  }
+
+  /** @brief Lock protecting the pool */
+  std::mutex lock;
+
+  /** @brief Free buffers in each size class */
+  std::vector<char *> free[CLASSES];
+
+  /** @brief Total size of free buffers */
+  size_t retained = 0;
+};
+
+Pool pool;
+
+/** @brief Find the size class for an allocation
+ * @param n Bytes required
+ * @return Size class
+ */
+unsigned size_class(size_t n) {
+  unsigned c = 0;
+  while(((size_t)1 << (c + MIN_SHIFT)) < n)
+    ++c;
+  assert(c < CLASSES);
+  return c;
+}
+
+} // namespace
+
+Buffer Buffer::get(size_t n) {
+  Buffer b;
+  unsigned c = size_class(n);
+  b.capacity = (size_t)1 << (c + MIN_SHIFT);
+  b.len = n;
+  {
+    std::lock_guard<std::mutex> g(pool.lock);
+    if(pool.free[c].size()) {
+      b.base = pool.free[c].back();
+      pool.free[c].pop_back();
+      pool.retained -= b.capacity;
+      return b;
+    }
+  }
+  void *ptr;
+  int rc = posix_memalign(&ptr, (size_t)1 << MIN_SHIFT, b.capacity);
+  if(rc)
+    syserror("posix_memalign", rc);
+  b.base = (char *)ptr;
+  return b;
+}
+
+Buffer::Buffer(Buffer &&other) noexcept :
+  base(other.base), capacity(other.capacity), len(other.len) {
+  other.base = nullptr;
+  other.capacity = other.len = 0;
+}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+  if(this != &other) {
+    release();
+    base = other.base;
+    capacity = other.capacity;
+    len = other.len;
+    other.base = nullptr;
+    other.capacity = other.len = 0;
+  }
+  return *this;
+}
+
+void Buffer::resize(size_t n) {
+  assert(n <= capacity);
+  len = n;
+}
+
+void Buffer::release() {
+  if(!base)
+    return;
+  {
+    std::lock_guard<std::mutex> g(pool.lock);
+    if(pool.retained + capacity <= MAX_RETAINED) {
+      pool.free[size_class(capacity)].push_back(base);
+      pool.retained += capacity;
+      base = nullptr;
+    }
+  }
+  ::free(base);
+  base = nullptr;
+  capacity = len = 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BUFFER_H
+#define BUFFER_H
+/** @file buffer.h
+ * @brief Pooled data buffers
+ */
+
+#include <config.h>
+#include <cstddef>
+
+/** @brief A buffer borrowed from a process-wide pool
+ *
+ * Buffers are move-only. When a buffer is destroyed its memory is
+ * returned to the pool for re-use, so large transfers can proceed without
+ * repeated allocation. Memory is page-aligned.
+ */
+class Buffer {
+public:
+  /** @brief Construct an empty buffer */
+  Buffer() = default;
+
+  /** @brief Allocate a buffer from the pool
+   * @param n Size of buffer
+   * @return Buffer with @ref size equal to @p n
+   */
+  static Buffer get(size_t n);
+
+  /** @brief Move constructor
+   * @param other Buffer to take ownership of
+   */
+  Buffer(Buffer &&other) noexcept;
+
+  /** @brief Move assignment
+   * @param other Buffer to take ownership of
+   * @return This buffer
+   */
+  Buffer &operator=(Buffer &&other) noexcept;
+
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+
+  /** @brief Destroy a buffer, returning its memory to the pool */
+  ~Buffer() {
+    release();
+  }
+
+  /** @brief Return the buffer contents */
+  char *data() {
+    return base;
+  }
+
+  /** @brief Return the buffer contents */
+  const char *data() const {
+    return base;
+  }
+
+  /** @brief Return the size of the buffer */
+  size_t size() const {
+    return len;
+  }
+
+  /** @brief Change the size of the buffer
+   * @param n New size
+   *
+   * @p n must not exceed the size the buffer was allocated with.
+   */
+  void resize(size_t n);
+
+  /** @brief Return the buffer's memory to the pool
+   *
+   * Afterwards the buffer is empty.
+   */
+  void release();
+
+private:
+  /** @brief Base of memory */
+  char *base = nullptr;
+
+  /** @brief Size of allocation */
+  size_t capacity = 0;
+
+  /** @brief Size of contents */
+  size_t len = 0;
+};
+
+#endif
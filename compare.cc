@@ -22,12 +22,24 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <cinttypes>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include <deque>
-#include "sftp.h"
+#include <exception>
+#include "budget.h"
+#include "delta.h"
+#include "pipewriter.h"
+#include "ring.h"
+#include "sftp-internal.h"
+#include "sha256.h"
+#include "window.h"
 
 Comparison::~Comparison() {
   if(debug)
@@ -37,7 +49,8 @@ Comparison::~Comparison() {
   join_threads();
   // Close SFTP connections
   for(auto &it : conns)
-    delete it.second;
+    for(auto conn : it.second)
+      delete conn;
   conns.clear();
 }
 
@@ -69,12 +82,71 @@ int Comparison::compare_files(const std::string &f1, const std::string &f2) {
   args.insert(args.end(), extra_args.begin(), extra_args.end());
 
   // Add the filenames, possibly replacing them with pipe endpoints,
-  // if they are remote files.
-  add_file(f1, args, NEW_AS_EMPTY_1);
-  add_file(f2, args, NEW_AS_EMPTY_2);
+  // if they are remote files. Requests for both files are issued before
+  // waiting for any replies.
+  File file1, file2;
+  file1.name = f1;
+  file1.fileno = NEW_AS_EMPTY_1;
+  file2.name = f2;
+  file2.fileno = NEW_AS_EMPTY_2;
+  start_file(file1);
+  start_file(file2);
+  try {
+    collect_file(file1);
+  } catch(std::exception &) {
+    // file2's opens are already in flight, so its handles must still be
+    // collected and released
+    try {
+      collect_file(file2);
+    } catch(std::exception &) {
+    }
+    discard_file(file2);
+    throw;
+  }
+  try {
+    collect_file(file2);
+  } catch(std::exception &) {
+    discard_file(file1);
+    throw;
+  }
+
+  // Files of different sizes differ, without need to look inside them
+  if(sizes_differ(file1, file2)) {
+    discard_file(file1);
+    discard_file(file2);
+    printf("Files %s and %s differ\n", f1.c_str(), f2.c_str());
+    return 1;
+  }
 
-  // Do the diff
-  int rc = run_diff(args);
+  // Files with matching digests need not be transferred at all
+  if(remote_hash && digests_match(file1, file2)) {
+    discard_file(file1);
+    discard_file(file2);
+    return report_identical(f1, f2);
+  }
+
+  // A large remote file can be rebuilt mostly from a local one
+  if(delta) {
+    if(file1.remote && !file2.remote)
+      delta_fetch(file1, file2);
+    else if(file2.remote && !file1.remote)
+      delta_fetch(file2, file1);
+  }
+
+  add_file(file1, args);
+  add_file(file2, args);
+
+  // Wait for any spooled files to be complete
+  for(auto &s : spools)
+    s();
+  spools.clear();
+
+  // Do the diff, unless the files are known to be identical
+  int rc;
+  if(identical(file1, file2))
+    rc = report_identical(f1, f2);
+  else
+    rc = exact() ? run_cmp(args, f1, f2) : run_diff(args);
 
   // Clean up the infrastructure we created.
   drain_fds();
@@ -84,82 +156,882 @@ int Comparison::compare_files(const std::string &f1, const std::string &f2) {
   return rc;
 }
 
-void Comparison::add_file(const std::string &f, std::vector<std::string> &args,
-                          int fileno) {
+#if !HAVE_COROUTINES
+/** @brief Event-driven equivalent of @ref Comparison::feed_file
+ *
+ * Everything except construction happens in the event loop thread. The
+ * feeder keeps itself alive until all its reads have completed or been
+ * abandoned.
+ */
+class Comparison::Feeder : public std::enable_shared_from_this<Feeder> {
+public:
+  /** @brief Construct a feeder
+   * @param c Comparison
+   * @param lanes Connections and handles for the file
+   * @param context Context string for diagnostics
+   * @param fd Output file descriptor (non-blocking)
+   * @param pipe Writer for @p fd
+   *
+   * The handles in @p lanes and @p fd will be closed.
+   */
+  Feeder(Comparison &c, const std::vector<Lane> &lanes,
+         const std::string &context, int fd, PipeWriter *pipe) :
+    loop(c.loop.get()), lanes(lanes), context(context), fd(fd), pipe(pipe),
+    window(c.min_window, c.max_window), limit(c.buffer_limit),
+    chunk(window.maximum()), read_templates(lanes.size()) {
+    // Read as much as the servers allow in each request
+    for(auto &lane : lanes)
+      if(lane.conn->max_read_length() < chunk)
+        chunk = lane.conn->max_read_length();
+    for(size_t n = 0; n < lanes.size(); ++n)
+      lanes[n].conn->read_template(lanes[n].handle, read_templates[n]);
+  }
+
+  /** @brief Start feeding */
+  void start() {
+    std::shared_ptr<Feeder> self = shared_from_this();
+    done = finished.get_future();
+    loop->post([self]() { self->advance(); });
+  }
+
+  /** @brief Wait for the feeder to finish
+   *
+   * Must not be called from the event loop thread.
+   */
+  void wait() {
+    done.wait();
+  }
+
+private:
+  /** @brief A read that has been issued but not yet consumed */
+  struct Request {
+    /** @brief Index into @c lanes */
+    size_t lane;
+
+    /** @brief Offset of read */
+    uint64_t offset;
+
+    /** @brief Length requested */
+    uint32_t len;
+
+    /** @brief Request ID */
+    uint32_t id;
+
+    /** @brief When the read was issued */
+    ReadWindow::clock::time_point sent;
+
+    /** @brief Set when the read has completed */
+    bool done = false;
+
+    /** @brief Data read */
+    Buffer data;
+
+    /** @brief Error, if the read failed */
+    std::exception_ptr failure;
+  };
+
+  /** @brief Event loop */
+  EventLoop *loop;
+
+  /** @brief Connections and handles for the file */
+  std::vector<Lane> lanes;
+
+  /** @brief Context string for diagnostics */
+  std::string context;
+
+  /** @brief Output file descriptor, or -1 when closed */
+  int fd;
+
+  /** @brief Writer for @c fd */
+  PipeWriter *pipe;
+
+  /** @brief Read window */
+  ReadWindow window;
+
+  /** @brief Limit on @c inflight plus @c buffered */
+  size_t limit;
+
+  /** @brief Share of the global memory budget */
+  Reservation reservation;
+
+  /** @brief Size of each read */
+  size_t chunk;
+
+  /** @brief Read template for each lane */
+  std::vector<SFTP::Connection::ReadTemplate> read_templates;
+
+  /** @brief Outstanding reads, in file order
+   *
+   * Elements are only removed from the front, and only once complete, so
+   * completions can safely hold pointers to them.
+   */
+  std::deque<Request> requests;
+
+  /** @brief Next offset to request */
+  uint64_t offset = 0;
+
+  /** @brief Bytes requested but not yet received */
+  size_t inflight = 0;
+
+  /** @brief Bytes received but not yet consumed */
+  size_t buffered = 0;
+
+  /** @brief Next lane to use */
+  size_t next_lane = 0;
+
+  /** @brief Number of reads that have not completed */
+  size_t outstanding = 0;
+
+  /** @brief Set at EOF */
+  bool eof = false;
+
+  /** @brief Set once no more data will be written */
+  bool stopping = false;
+
+  /** @brief Set when waiting for @c fd to become writable */
+  bool write_blocked = false;
+
+  /** @brief Data being written */
+  Buffer output;
+
+  /** @brief Bytes of @c output written so far */
+  size_t output_done = 0;
+
+  /** @brief Fulfilled when the feeder is finished */
+  std::promise<void> finished;
+
+  /** @brief Future for @c finished */
+  std::future<void> done;
+
+  /** @brief Issue a read
+   * @param lane Lane to use
+   * @param at Offset of read
+   * @param len Length of read
+   * @param front Put the read at the front of the queue
+   */
+  void issue(size_t lane, uint64_t at, uint32_t len, bool front) {
+    if(front)
+      requests.emplace_front();
+    else
+      requests.emplace_back();
+    Request *r = front ? &requests.front() : &requests.back();
+    r->lane = lane;
+    r->offset = at;
+    r->len = len;
+    r->sent = ReadWindow::clock::now();
+    std::shared_ptr<Feeder> self = shared_from_this();
+    SFTP::Connection *conn = lanes[lane].conn;
+    unsigned stream = lanes[lane].stream;
+    conn->scheduler().issued(stream, len);
+    r->id = conn->queue_read(
+      read_templates[lane], at, len,
+      [self, r, conn, stream](Buffer &data, std::exception_ptr failure) {
+        conn->scheduler().completed(stream, r->len);
+        r->data = std::move(data);
+        r->failure = failure;
+        r->done = true;
+        self->inflight -= r->len;
+        self->buffered += r->len;
+        --self->outstanding;
+        self->advance();
+      });
+    ++outstanding;
+  }
+
+  /** @brief Make as much progress as possible */
+  void advance() {
+    if(stopping) {
+      finish();
+      return;
+    }
+    try {
+      for(;;) {
+        // Write out whatever we have
+        while(!write_blocked && output_done < output.size()) {
+          ssize_t written = pipe->write(output, output_done);
+          if(written < 0) {
+            if(errno == EAGAIN) {
+              // Wait until diff has caught up, but keep reading meanwhile
+              std::shared_ptr<Feeder> self = shared_from_this();
+              write_blocked = true;
+              loop->watch(fd, EventLoop::WRITE, [self](unsigned) {
+                self->loop->unwatch(self->fd);
+                self->write_blocked = false;
+                self->advance();
+              });
+              break;
+            }
+            if(errno == EPIPE) {
+              // diff stopped before reading everything (possibly it never
+              // even ran)
+              stop();
+              return;
+            }
+            syserror(context + ": write");
+          }
+          output_done += written;
+        }
+        if(output_done < output.size())
+          break;
+        output.release();
+        output_done = 0;
+        if(requests.empty() || !requests.front().done)
+          break;
+        // Consume the next read
+        Request r = std::move(requests.front());
+        requests.pop_front();
+        buffered -= r.len;
+        if(r.failure)
+          std::rethrow_exception(r.failure);
+        window.sample(r.data.size(), ReadWindow::clock::now() - r.sent);
+        if(r.data.size() == 0) {
+          // EOF. Any later reads will get EOF too.
+          eof = true;
+          break;
+        }
+        if(r.data.size() < r.len) {
+          // Short read; fetch the rest of the range before anything later.
+          uint32_t rest = r.len - r.data.size();
+          issue(r.lane, r.offset + r.data.size(), rest, true);
+          inflight += rest;
+        }
+        output = std::move(r.data);
+      }
+      if(eof) {
+        if(debug)
+          fprintf(stderr,
+                  "DEBUG: %s complete, window %zu bytes (rtt %.1fms, rate "
+                  "%.0f bytes/s%s)\n",
+                  __func__, window.size(), window.rtt() * 1000, window.rate(),
+                  window.starting() ? ", slow start" : "");
+        stop();
+        return;
+      }
+      // Fill the window, as far as the memory limits and each connection's
+      // fair share allow
+      size_t demand = window.size() / lanes.size();
+      size_t held = inflight + buffered + output.size();
+      reservation.resize(held);
+      while(inflight + buffered < limit
+            && (requests.empty()
+                || (inflight < window.size()
+                    && lanes[next_lane].credit(demand)))
+            && reservation.resize(held + chunk)) {
+        issue(next_lane, offset, chunk, false);
+        next_lane = (next_lane + 1) % lanes.size();
+        offset += chunk;
+        inflight += chunk;
+        held += chunk;
+      }
+      for(auto &lane : lanes)
+        lane.conn->flush();
+    } catch(std::runtime_error &e) {
+      fprintf(stderr, "ERROR: %s\n", e.what());
+      stop();
+    }
+  }
+
+  /** @brief Stop writing and wind down */
+  void stop() {
+    stopping = true;
+    if(write_blocked) {
+      loop->unwatch(fd);
+      write_blocked = false;
+    }
+    if(fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    // Make sure any queued reads have actually been sent, so that their
+    // replies can be recognized, and abandon them.
+    for(auto &lane : lanes) {
+      try {
+        lane.conn->flush();
+      } catch(std::runtime_error &e) {
+        // Ignore any errors
+      }
+    }
+    for(auto &r : requests)
+      if(!r.done && lanes[r.lane].conn->abandon(r.id))
+        --outstanding;
+    finish();
+  }
+
+  /** @brief Finish once all reads have completed or been abandoned */
+  void finish() {
+    if(outstanding > 0 || lanes.empty())
+      return;
+    for(auto &lane : lanes) {
+      lane.conn->scheduler().remove(lane.stream);
+      try {
+        lane.conn->close_detached(lane.handle);
+      } catch(std::runtime_error &e) {
+        // Ignore any errors
+      }
+    }
+    lanes.clear();
+    reservation.resize(0);
+    finished.set_value();
+  }
+};
+#endif
+
+/** @brief Create an in-memory file to spool a remote file into
+ * @param fds Where to store the descriptor to pass to diff and the
+ * descriptor to feed
+ * @return @c true on success, @c false if not supported
+ *
+ * The two descriptors share a file position. The second is close-on-exec.
+ */
+static bool create_spool(int fds[2]) {
+#if HAVE_MEMFD_CREATE
+  int fd = memfd_create("remdiff", 0);
+  if(fd < 0) {
+    if(errno == ENOSYS)
+      return false;
+    syserror("memfd_create");
+  }
+  int wfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if(wfd < 0) {
+    close(fd);
+    syserror("fcntl");
+  }
+  fds[0] = fd;
+  fds[1] = wfd;
+  return true;
+#else
+  (void)fds;
+  return false;
+#endif
+}
+
+bool Comparison::Lane::credit(size_t demand) const {
+  Scheduler &s = conn->scheduler();
+  if(s.credit(stream, demand) > 0)
+    return true;
   if(debug)
-    fprintf(stderr, "DEBUG: %s %s\n", __func__, f.c_str());
-  std::string newname = f;
+    fprintf(stderr, "DEBUG: %s: waiting for fair share: %s\n", __func__,
+            s.status().c_str());
+  return false;
+}
 
+void Comparison::start_file(File &file) {
   size_t colon;
-  if((colon = f.find(':')) == std::string::npos) {
+  if((colon = file.name.find(':')) == std::string::npos)
+    return;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s\n", __func__, file.name.c_str());
+  // Parse the filename
+  std::string host = file.name.substr(0, colon);
+  file.path = file.name.substr(colon + 1);
+  file.remote = true;
+
+  // All connections share a single event loop, if one is wanted
+  if(event_loop && !loop) {
+    loop.reset(new EventLoop());
+    transport.loop = loop.get();
+  }
+
+  // Make sure we have SFTP connections. If both files are on the same
+  // host we can share the connections.
+  std::vector<SFTP::Connection *> &host_conns = conns[host];
+  while(host_conns.size() < connections)
+    host_conns.push_back(new SFTP::Connection(host, transport));
+
+  // Ensure they are connected
+  for(auto conn : host_conns)
+    conn->connect();
+  file.conns = host_conns;
+
+  // Open the file on every connection, and find out what it is, all
+  // without waiting. SFTP v3 can't refer to a handle before it exists, so
+  // the stat is by name.
+  for(auto conn : host_conns)
+    file.opens.push_back(conn->open_async(file.path, SSH_FXF_READ));
+  file.attrs = host_conns[0]->stat_async(file.path);
+}
+
+void Comparison::collect_file(File &file) {
+  const std::string &f = file.name;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s\n", __func__, f.c_str());
+  if(!file.remote) {
     // Local file. See if it exists.
     struct stat statbuf;
     if(stat(f.c_str(), &statbuf) < 0) {
-      if(errno == ENOENT && (fileno & flags))
-        newname = "/dev/null";
+      if(errno == ENOENT && (file.fileno & flags))
+        file.missing = true;
       else
         syserror(f);
     } else {
       // Reject directories without even opening them
       if(S_ISDIR(statbuf.st_mode))
         syserror(f, EISDIR);
-      newname = f;
+      file.sized = S_ISREG(statbuf.st_mode);
+      file.size = statbuf.st_size;
     }
   } else {
-    // Parse the filename
-    std::string host = f.substr(0, colon);
-    std::string path = f.substr(colon + 1);
-
-    // Make sure we have an SFTP connection. If both files are on the same
-    // host we can share the connection.
-    SFTP::Connection *conn;
-    auto it = conns.find(host);
-    if(it == conns.end()) {
-      conn = new SFTP::Connection(host);
-      conns[host] = conn;
-    } else
-      conn = it->second;
+    // Collect the open replies. All of them must be collected, even after a
+    // failure, so that any handles that were opened can be closed.
+    std::exception_ptr failure;
+    for(size_t n = 0; n < file.conns.size(); ++n) {
+      try {
+        file.lanes.push_back({ file.conns[n], file.opens[n].get(), 0 });
+      } catch(std::exception &) {
+        if(!failure)
+          failure = std::current_exception();
+      }
+    }
+    // Collect the stat reply
+    SFTP::Attributes attrs;
+    try {
+      attrs = file.attrs.get();
+    } catch(std::exception &) {
+      if(!failure)
+        failure = std::current_exception();
+    }
+    if(failure) {
+      discard_file(file);
+      try {
+        std::rethrow_exception(failure);
+      } catch(SFTP::Error &e) {
+        if(e.status != SSH_FX_NO_SUCH_FILE || !(file.fileno & flags))
+          throw;
+        file.missing = true;
+      }
+    } else {
+      // Reject directories
+      if(S_ISDIR(attrs.permissions)) {
+        discard_file(file);
+        syserror(f, EISDIR);
+      }
+      file.sized = (attrs.flags & SSH_FILEXFER_ATTR_SIZE)
+                   && (!(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+                       || S_ISREG(attrs.permissions));
+      file.size = attrs.size;
+    }
+  }
+  // A missing file is treated as empty
+  if(file.missing) {
+    file.sized = true;
+    file.size = 0;
+  }
+}
 
-    // Ensure it is connected
-    conn->connect();
+void Comparison::discard_file(File &file) {
+  for(auto &lane : file.lanes)
+    lane.conn->close_detached(lane.handle);
+  file.lanes.clear();
+}
 
-    // Attempt to open the file
-    std::string handle;
-    bool open_ok;
+bool Comparison::exact() const {
+  return mode == 'q' && !(flags & NORMALIZE);
+}
+
+bool Comparison::sizes_differ(const File &file1, const File &file2) const {
+  if(!file1.sized || !file2.sized || file1.size == file2.size || !exact())
+    return false;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %" PRIu64 " %" PRIu64 "\n", __func__,
+            file1.size, file2.size);
+  return true;
+}
+
+bool Comparison::skippable() const {
+  bool suppress_common = false;
+  for(auto &arg : extra_args) {
+    // --ifdef outputs the merged file even if there are no differences
+    if(arg.compare(0, 7, "--ifdef") == 0)
+      return false;
+    if(arg == "--suppress-common-lines")
+      suppress_common = true;
+  }
+  // Side-by-side output shows common lines unless told not to
+  return mode != 'y' || suppress_common;
+}
+
+/** @brief Hash a local file
+ * @param path Filename
+ * @param digest Where to store the digest
+ * @return @c true on success, @c false on error
+ *
+ * Errors are left for diff to report.
+ */
+static bool hash_local(const std::string &path, std::string &digest) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  const size_t chunk = 256 * 1024;
+  std::vector<char> buffer(chunk);
+  Sha256 hash;
+  ssize_t n;
+  while((n = readall(fd, &buffer[0], chunk)) > 0)
+    hash.update(&buffer[0], n);
+  close(fd);
+  if(n < 0)
+    return false;
+  digest = hash.finish();
+  return true;
+}
+
+bool Comparison::get_digest(const File &file, std::string &digest) {
+  if(file.missing) {
+    digest = Sha256().finish();
+    return true;
+  }
+  if(file.remote) {
+    if(!file.spool)
+      return false;
+    digest = file.spool->digest();
+    return !digest.empty();
+  }
+  if(!file.sized || file.size > spool_limit)
+    return false;
+  return hash_local(file.name, digest);
+}
+
+bool Comparison::identical(const File &file1, const File &file2) {
+  // An exact comparison stops at the first difference without running diff
+  // anyway, so it has nothing to gain from hashing the files.
+  if(!skippable() || exact())
+    return false;
+  if(file1.sized && file2.sized && file1.size != file2.size)
+    return false;
+  // Check both files can be hashed before reading either
+  for(const File *file : { &file1, &file2 })
+    if(!file->missing
+       && (file->remote ? !file->spool
+                        : !file->sized || file->size > spool_limit))
+      return false;
+  std::string digest1, digest2;
+  if(!get_digest(file1, digest1) || !get_digest(file2, digest2))
+    return false;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, digest1.c_str(),
+            digest2.c_str());
+  return digest1 == digest2;
+}
+
+bool Comparison::digests_match(const File &file1, const File &file2) {
+  if(!skippable() || (!file1.remote && !file2.remote))
+    return false;
+  if(file1.sized && file2.sized && file1.size != file2.size)
+    return false;
+  // Local files must be regular and are only read once the remote digests
+  // are known, since the remote hosts may not be able to provide them.
+  for(const File *file : { &file1, &file2 })
+    if(!file->remote && !file->missing && !file->sized)
+      return false;
+  std::string digests[2];
+  const File *files[2] = { &file1, &file2 };
+  for(int n = 0; n < 2; ++n) {
+    const File &file = *files[n];
+    if(file.remote && !file.missing) {
+      digests[n] = file.lanes[0].conn->digest(file.path);
+      if(digests[n].empty())
+        return false;
+    }
+  }
+  for(int n = 0; n < 2; ++n) {
+    const File &file = *files[n];
+    if(file.missing)
+      digests[n] = Sha256().finish();
+    else if(!file.remote && !hash_local(file.name, digests[n]))
+      return false;
+  }
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, digests[0].c_str(),
+            digests[1].c_str());
+  return digests[0] == digests[1];
+}
+
+/** @brief Smallest remote file worth fetching with @ref Comparison::delta
+ *
+ * Below this size the extra SSH session costs more than it saves.
+ */
+#define DELTA_MINIMUM (1024 * 1024)
+
+/** @brief Create an anonymous temporary file
+ * @return File descriptor
+ */
+static int create_temporary() {
+  const char *tmpdir = getenv("TMPDIR");
+  std::string dir = tmpdir && *tmpdir ? tmpdir : "/tmp";
+  int fd;
+#ifdef O_TMPFILE
+  if((fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600)) >= 0)
+    return fd;
+#endif
+  // Fall back to a named file, removed at once
+  std::string path = dir + "/remdiff.XXXXXX";
+  if((fd = mkstemp(&path[0])) < 0)
+    syserror(path);
+  unlink(path.c_str());
+  return fd;
+}
+
+void Comparison::delta_fetch(File &remote, const File &local) {
+  if(remote.missing || !remote.sized || remote.size < DELTA_MINIMUM
+     || local.missing || !local.sized || local.size == 0)
+    return;
+  const std::string &f = remote.name;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, f.c_str(),
+            local.name.c_str());
+  // Get the checksums of the remote file's blocks
+  SFTP::Connection *conn = remote.lanes[0].conn;
+  // Blocks to fetch are grouped into reads, so no block should be bigger
+  // than a read
+  const size_t chunk = std::min(max_window, (size_t)conn->max_read_length());
+  size_t block = choose_block_size(remote.size, chunk);
+  std::string output;
+  BlockSums sums;
+  if(!conn->execute("remdiff --block-sums " + std::to_string(block) + " < "
+                      + shell_quote(remote.path),
+                    output)
+     || !sums.parse(output) || sums.size != remote.size) {
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s: no block checksums\n", __func__,
+              f.c_str());
+    return;
+  }
+  // Find the blocks in the local file. Any error is left for diff to report.
+  int lfd = open(local.name.c_str(), O_RDONLY | O_CLOEXEC);
+  if(lfd < 0)
+    return;
+  // Mapping past the end of a file that has shrunk since it was first
+  // looked at would fault when touched, so fetch it all instead
+  struct stat statbuf;
+  if(fstat(lfd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)
+     || (uint64_t)statbuf.st_size != local.size) {
+    close(lfd);
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s: local file changed\n", __func__,
+              local.name.c_str());
+    return;
+  }
+  void *map = mmap(nullptr, local.size, PROT_READ, MAP_PRIVATE, lfd, 0);
+  close(lfd);
+  if(map == MAP_FAILED)
+    return;
+  const uint8_t *data = static_cast<const uint8_t *>(map);
+  std::vector<int64_t> found = match_blocks(sums, data, local.size);
+
+  // Divide the file into ranges to copy and ranges to fetch
+  struct Segment {
+    uint64_t offset; // offset in remote file
+    uint64_t len;    // length
+    int64_t local;   // offset in local file, or -1 to fetch
+  };
+  std::vector<Segment> segments;
+  uint64_t fetching = 0;
+  for(size_t n = 0; n < found.size(); ++n) {
+    uint64_t offset = (uint64_t)n * block;
+    uint64_t len = std::min((uint64_t)block, sums.size - offset);
+    if(found[n] >= 0)
+      segments.push_back({ offset, len, found[n] });
+    else if(segments.size() && segments.back().local < 0
+            && segments.back().len + len <= chunk)
+      segments.back().len += len;
+    else
+      segments.push_back({ offset, len, -1 });
+    if(found[n] < 0)
+      fetching += len;
+  }
+  if(debug)
+    fprintf(stderr,
+            "DEBUG: %s %s: fetching %" PRIu64 " of %" PRIu64 " bytes\n",
+            __func__, f.c_str(), fetching, sums.size);
+
+  // Rebuild the file in order, keeping reads in flight ahead of the
+  // position being written
+  struct Request {
+    uint32_t id;
+    uint64_t offset;
+    uint32_t len;
+  };
+  std::deque<Request> requests;
+  size_t inflight = 0, issue = 0;
+  Reservation reservation;
+  SFTP::Connection::ReadTemplate t;
+  std::string fetched;
+  int out = create_temporary();
+  try {
+    conn->read_template(remote.lanes[0].handle, t);
+    auto put = [&](const char *bytes, size_t len) {
+      if(writeall(out, bytes, len) < 0)
+        syserror("writing temporary file");
+    };
+    for(auto &segment : segments) {
+      while(issue < segments.size()) {
+        const Segment &s = segments[issue];
+        if(s.local < 0) {
+          if((requests.size() && inflight + s.len > max_window)
+             || !reservation.resize(inflight + s.len))
+            break;
+          requests.push_back({ conn->queue_read(t, s.offset, s.len), s.offset,
+                               (uint32_t)s.len });
+          inflight += s.len;
+        }
+        ++issue;
+      }
+      conn->flush();
+      if(segment.local >= 0) {
+        put(reinterpret_cast<const char *>(data + segment.local), segment.len);
+        continue;
+      }
+      Request r = requests.front();
+      requests.pop_front();
+      Buffer result = conn->finish_read(r.id);
+      inflight -= r.len;
+      reservation.resize(inflight);
+      fetched.assign(result.data(), result.size());
+      // Short reads: fetch the rest of the range before moving on
+      while(fetched.size() < r.len) {
+        uint32_t rest = r.len - fetched.size();
+        uint32_t id = conn->queue_read(t, r.offset + fetched.size(), rest);
+        conn->flush();
+        result = conn->finish_read(id);
+        if(result.size() == 0)
+          break;
+        fetched.append(result.data(), result.size());
+      }
+      // Copied blocks were checked when they were matched; check fetched
+      // ones too, in case the file has changed since it was checksummed.
+      if(fetched.size() != r.len)
+        throw std::runtime_error(f + ": file changed during transfer");
+      for(uint64_t pos = 0; pos < r.len; pos += block)
+        if(!sums.verify((r.offset + pos) / block, fetched.data() + pos,
+                        std::min((uint64_t)block, r.len - pos)))
+          throw std::runtime_error(f + ": file changed during transfer");
+      put(fetched.data(), fetched.size());
+    }
+    if(lseek(out, 0, SEEK_SET) < 0)
+      syserror("lseek");
+  } catch(std::runtime_error &e) {
+    fprintf(stderr, "WARNING: %s; fetching whole file\n", e.what());
     try {
-      handle = conn->open(path, SSH_FXF_READ);
-      open_ok = true;
-    } catch(SFTP::Error &e) {
-      if(e.status != SSH_FX_NO_SUCH_FILE || !(fileno & flags))
-        throw;
-      newname = "/dev/null";
+      conn->flush();
+    } catch(std::runtime_error &) {
+      // Ignore any errors
     }
+    for(auto &r : requests)
+      conn->abandon(r.id);
+    close(out);
+    munmap(map, local.size);
+    return;
+  }
+  munmap(map, local.size);
+  remote.rebuilt = out;
+}
 
-    if(open_ok) {
-      // Reject directories
-      SFTP::Attributes attrs;
-      conn->fstat(handle, attrs);
-      if(S_ISDIR(attrs.permissions))
-        syserror(f, EISDIR);
+int Comparison::report_identical(const std::string &f1,
+                                 const std::string &f2) {
+  if(flags & REPORT_IDENTICAL) {
+    printf("Files %s and %s are identical\n", f1.c_str(), f2.c_str());
+    if(ferror(stdout)) {
+      fprintf(stderr, "ERROR: writing to stdout: %s\n", strerror(errno));
+      exit(2);
+    }
+  }
+  return 0;
+}
+
+void Comparison::add_file(File &file, std::vector<std::string> &args) {
+  const std::string &f = file.name;
+  int fileno = file.fileno;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s\n", __func__, f.c_str());
+  std::string newname = f;
 
-      // Create a pipe to feed it to the child
-      int p[2];
+  if(file.missing)
+    newname = "/dev/null";
+  else if(file.rebuilt >= 0) {
+    // The remote handles are no longer needed
+    discard_file(file);
+    fds.push_back(file.rebuilt);
+    newname = "/dev/fd/" + std::to_string(file.rebuilt);
+  } else if(file.remote) {
+    std::vector<Lane> &lanes = file.lanes;
+    // Small files are spooled into memory, so that diff gets a regular
+    // file with a known size. Otherwise, create a pipe to feed it to the
+    // child. An exact comparison reads both files in step, so it gains
+    // nothing from spooling and could stop early without it.
+    int p[2];
+    bool spool = spool_limit > 0 && file.sized && file.size <= spool_limit
+                 && !exact() && create_spool(p);
+    if(!spool) {
       if(pipe(p) < 0)
         syserror("pipe");
       // Don't leak the writer end of the pipe.
       close_on_exec(p[1]);
+    }
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s via %s\n", __func__, f.c_str(),
+              spool ? "spool" : "pipe");
 
-      // Create a thread to do feeding
-      threads.push_back(
-        std::thread(Comparison::feed_file, conn, f, handle, p[1]));
-      fds.push_back(p[0]);
-      // TODO push this into run_diff?
+    // Share each connection fairly with the other file
+    for(auto &lane : lanes)
+      lane.stream = lane.conn->scheduler().add(f);
 
-      // Replace the filename with the reader end of the pipe
-      char buffer[128];
-      snprintf(buffer, sizeof buffer, "/dev/fd/%d", p[0]);
-      newname = buffer;
+    // Create a thread or an event-driven feeder to do feeding
+    if(loop && !spool)
+      nonblock(p[1]);
+    pipes.push_back(std::unique_ptr<PipeWriter>(new PipeWriter(p[1])));
+    PipeWriter *writer = pipes.back().get();
+    // Spooled data is hashed on the way in, so that identical files can be
+    // recognized without running diff
+    if(spool) {
+      file.spool = writer;
+      if(skippable())
+        writer->start_digest();
+    }
+    if(loop) {
+#if HAVE_COROUTINES
+      std::vector<SFTP::Connection::ReadTemplate> read_templates(
+        lanes.size());
+      for(size_t n = 0; n < lanes.size(); ++n)
+        lanes[n].conn->read_template(lanes[n].handle, read_templates[n]);
+      feeders.push_back(
+        Coro::spawn(loop.get(),
+                    feed_task(lanes, f, p[1], writer, read_templates)));
+#else
+      std::shared_ptr<Feeder> feeder =
+        std::make_shared<Feeder>(*this, lanes, f, p[1], writer);
+      feeder->start();
+      feeders.push_back(feeder);
+#endif
+    } else
+      threads.push_back(
+        std::thread(&Comparison::feed_file, this, lanes, f, p[1], writer));
+    fds.push_back(p[0]);
+    // TODO push this into run_diff?
+    if(spool) {
+      // diff mustn't start until the spool is complete
+      size_t n = loop ? feeders.size() - 1 : threads.size() - 1;
+      int fd = p[0];
+      spools.push_back([this, n, fd]() {
+        if(loop)
+#if HAVE_COROUTINES
+          feeders[n].wait();
+#else
+          feeders[n]->wait();
+#endif
+        else
+          threads[n].join();
+        // The feeder's descriptor shared our file position
+        if(lseek(fd, 0, SEEK_SET) < 0)
+          syserror("lseek");
+      });
     }
+
+    // Replace the filename with the reader end of the pipe or the spool
+    char buffer[128];
+    snprintf(buffer, sizeof buffer, "/dev/fd/%d", p[0]);
+    newname = buffer;
   }
 
   // Use the new name
@@ -194,10 +1066,10 @@ void Comparison::add_file(const std::string &f, std::vector<std::string> &args,
       break;
     default: fprintf(stderr, "ERROR: unsupported mode %d\n", mode); exit(2);
     }
-    // TODO the REPORT_IDENTICAL support is not great; files that differ
-    // but have, e.g. 'and /dev/fd/3' in the difference will produce mangled
-    // output. A fix might be to hash the files (easy for remote files, can hash
-    // in feed_file) and synthesize the REPORT_IDENTICAL message if they match.
+    // TODO the brief and REPORT_IDENTICAL support is not great; files that
+    // differ but have, e.g. 'and /dev/fd/3' in the difference will produce
+    // mangled output. Files that can be hashed and turn out to be identical
+    // never reach diff (see identical()), but the rest still rely on this.
     if(mode == 'q' || (flags & REPORT_IDENTICAL)) {
       switch(fileno) {
       case 1:
@@ -217,60 +1089,295 @@ void Comparison::add_file(const std::string &f, std::vector<std::string> &args,
   }
 }
 
-void Comparison::feed_file(SFTP::Connection *conn, std::string context,
-                           std::string handle, int fd) {
+void Comparison::feed_file(std::vector<Lane> lanes, std::string context,
+                           int fd, PipeWriter *pipe) {
   if(debug)
     fprintf(stderr, "DEBUG: %s\n", __func__);
-  uint32_t id;
-  uint64_t offset = 0;
-  size_t chunk = 4096;
-  std::string result;
-  size_t inflight_limit = 4;
-  std::deque<uint32_t> ids;
+  // A read that has been issued but not yet consumed
+  struct Request {
+    size_t lane;
+    uint32_t id;
+    uint64_t offset;
+    uint32_t len;
+    ReadWindow::clock::time_point sent;
+  };
+  uint64_t offset = 0; // next offset to request
+  size_t inflight = 0; // bytes requested but not yet received
+  size_t next_lane = 0;
+  ReadWindow window(min_window, max_window);
+  // Read as much as the servers allow in each request
+  size_t chunk = window.maximum();
+  for(auto &lane : lanes)
+    if(lane.conn->max_read_length() < chunk)
+      chunk = lane.conn->max_read_length();
+  bool eof = false;
+  Buffer result;
+  std::deque<Request> requests;
+  std::vector<SFTP::Connection::ReadTemplate> read_templates(lanes.size());
+  // Data received but not yet written to diff
+  Ring ring;
+  // Share of the global memory budget
+  Reservation reservation;
+  std::thread writer([&ring, &context, pipe]() {
+    Buffer data;
+    try {
+      while(ring.pop(data)) {
+        if(pipe->writeall(data) < 0) {
+          if(errno == EPIPE) {
+            // diff stopped before reading everything (possibly it never
+            // even ran)
+            break;
+          }
+          syserror(context + ": write");
+        }
+      }
+    } catch(std::runtime_error &e) {
+      fprintf(stderr, "ERROR: %s\n", e.what());
+    }
+    ring.abandon();
+  });
 
   try {
+    for(size_t n = 0; n < lanes.size(); ++n)
+      lanes[n].conn->read_template(lanes[n].handle, read_templates[n]);
     for(;;) {
-      // Make sure there are plenty of reads in flight.
-      while(ids.size() < inflight_limit) {
-        id = conn->begin_read(handle, offset, chunk);
+      // Fill the window, as far as the memory limits and each connection's
+      // fair share allow.
+      size_t buffered = ring.size();
+      size_t demand = window.size() / lanes.size();
+      reservation.resize(inflight + buffered);
+      while(!eof && inflight + buffered < buffer_limit
+            && (requests.empty()
+                || (inflight < window.size()
+                    && lanes[next_lane].credit(demand)))
+            && reservation.resize(inflight + buffered + chunk)) {
+        Lane &lane = lanes[next_lane];
+        lane.conn->scheduler().issued(lane.stream, chunk);
+        uint32_t id =
+          lane.conn->queue_read(read_templates[next_lane], offset, chunk);
+        requests.push_back({ next_lane, id, offset, (uint32_t)chunk,
+                             ReadWindow::clock::now() });
+        next_lane = (next_lane + 1) % lanes.size();
         offset += chunk;
-        ids.push_back(id);
+        inflight += chunk;
+      }
+      for(auto &lane : lanes)
+        lane.conn->flush();
+      if(requests.empty()) {
+        if(eof)
+          break;
+        // Everything is waiting for diff; wait until it catches up.
+        if(!ring.wait_below(std::max(buffered, (size_t)1)))
+          break;
+        continue;
       }
       // Wait for the next read to finish
-      id = ids.front();
-      ids.pop_front();
-      result = conn->finish_read(id);
-      if(result.size() == 0)
+      Request r = requests.front();
+      requests.pop_front();
+      inflight -= r.len;
+      SFTP::Connection *conn = lanes[r.lane].conn;
+      result = conn->finish_read(r.id);
+      conn->scheduler().completed(lanes[r.lane].stream, r.len);
+      window.sample(result.size(), ReadWindow::clock::now() - r.sent);
+      if(result.size() == 0) {
+        // EOF. Any later reads will get EOF too.
+        eof = true;
         break;
-      if(writeall(fd, &result[0], result.size()) < 0) {
-        if(errno == EPIPE) {
-          // diff stopped before reading everything (possibly it never even
-          // ran)
-          break;
+      }
+      if(result.size() < r.len) {
+        // Short read; fetch the rest of the range before anything later.
+        uint32_t rest = r.len - result.size();
+        conn->scheduler().issued(lanes[r.lane].stream, rest);
+        uint32_t id = conn->queue_read(read_templates[r.lane],
+                                       r.offset + result.size(), rest);
+        conn->flush();
+        requests.push_front({ r.lane, id, r.offset + result.size(), rest,
+                              ReadWindow::clock::now() });
+        inflight += rest;
+      }
+      ring.push(std::move(result));
+      if(ring.abandoned())
+        break;
+    }
+    if(debug)
+      fprintf(stderr,
+              "DEBUG: %s complete, window %zu bytes (rtt %.1fms, rate %.0f "
+              "bytes/s%s)\n",
+              __func__, window.size(), window.rtt() * 1000, window.rate(),
+              window.starting() ? ", slow start" : "");
+    ring.close();
+  } catch(std::runtime_error &e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    ring.abandon();
+  }
+  writer.join();
+  // Abandon any remaining reads, making sure they have actually been sent
+  // so that their replies can be recognized and discarded.
+  for(auto &lane : lanes) {
+    try {
+      lane.conn->flush();
+    } catch(std::runtime_error &e) {
+      // Ignore any errors
+    }
+  }
+  for(auto &r : requests)
+    lanes[r.lane].conn->abandon(r.id);
+  // We own the local and remote file descriptors. There is no need to
+  // wait for the remote handles to be closed.
+  close(fd);
+  for(auto &lane : lanes) {
+    lane.conn->scheduler().remove(lane.stream);
+    try {
+      lane.conn->close_detached(lane.handle);
+    } catch(std::runtime_error &e) {
+      // Ignore any errors
+    }
+  }
+}
+
+#if HAVE_COROUTINES
+Coro::Task<void> Comparison::feed_task(
+  std::vector<Lane> lanes, std::string context, int fd, PipeWriter *pipe,
+  std::vector<SFTP::Connection::ReadTemplate> read_templates) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s\n", __func__);
+  // A read that has been issued but not yet consumed
+  struct Request {
+    size_t lane;
+    uint32_t id;
+    uint64_t offset;
+    uint32_t len;
+    ReadWindow::clock::time_point sent;
+    Coro::Op<Buffer> op;
+  };
+  uint64_t offset = 0; // next offset to request
+  size_t inflight = 0; // bytes requested but not yet consumed
+  size_t next_lane = 0;
+  bool eof = false, stopped = false;
+  Buffer result;
+  std::deque<Request> requests;
+  ReadWindow window(min_window, max_window);
+  // Read as much as the servers allow in each request
+  size_t chunk = window.maximum();
+  for(auto &lane : lanes)
+    if(lane.conn->max_read_length() < chunk)
+      chunk = lane.conn->max_read_length();
+  Reservation reservation; // share of the global memory budget
+  // Issue reads until the limits or each connection's fair share is reached
+  auto fill = [&](size_t limit) {
+    size_t demand = window.size() / lanes.size();
+    reservation.resize(inflight + result.size());
+    while(!eof
+          && (requests.empty()
+              || (inflight < limit && lanes[next_lane].credit(demand)))
+          && reservation.resize(inflight + result.size() + chunk)) {
+      SFTP::Connection &conn = *lanes[next_lane].conn;
+      conn.scheduler().issued(lanes[next_lane].stream, chunk);
+      uint32_t id;
+      Coro::Op<Buffer> op =
+        Coro::read(conn, read_templates[next_lane], offset, chunk, id);
+      requests.push_back({ next_lane, id, offset, (uint32_t)chunk,
+                           ReadWindow::clock::now(), std::move(op) });
+      next_lane = (next_lane + 1) % lanes.size();
+      offset += chunk;
+      inflight += chunk;
+    }
+    for(auto &lane : lanes)
+      lane.conn->flush();
+  };
+
+  try {
+    for(;;) {
+      // Fill the window.
+      fill(std::min(window.size(), buffer_limit));
+      if(requests.empty())
+        break;
+      // Wait for the next read to finish
+      Request r = std::move(requests.front());
+      requests.pop_front();
+      inflight -= r.len;
+      SFTP::Connection &conn = *lanes[r.lane].conn;
+      result = co_await r.op;
+      conn.scheduler().completed(lanes[r.lane].stream, r.len);
+      window.sample(result.size(), ReadWindow::clock::now() - r.sent);
+      if(result.size() == 0) {
+        // EOF. Any later reads will get EOF too.
+        eof = true;
+        break;
+      }
+      if(result.size() < r.len) {
+        // Short read; fetch the rest of the range before anything later.
+        uint32_t rest = r.len - result.size();
+        uint64_t at = r.offset + result.size();
+        conn.scheduler().issued(lanes[r.lane].stream, rest);
+        uint32_t id;
+        Coro::Op<Buffer> op =
+          Coro::read(conn, read_templates[r.lane], at, rest, id);
+        requests.push_front({ r.lane, id, at, rest, ReadWindow::clock::now(),
+                              std::move(op) });
+        conn.flush();
+        inflight += rest;
+      }
+      // Write it out, waiting whenever diff falls behind
+      size_t written = 0;
+      while(written < result.size()) {
+        ssize_t n = pipe->write(result, written);
+        if(n < 0) {
+          if(errno == EAGAIN) {
+            // Keep the network busy up to the memory limit while diff
+            // catches up
+            fill(buffer_limit);
+            co_await Coro::Writable(loop.get(), fd);
+            continue;
+          }
+          if(errno == EPIPE) {
+            // diff stopped before reading everything (possibly it never
+            // even ran)
+            stopped = true;
+            break;
+          }
+          syserror(context + ": write");
         }
-        syserror(context + ": write");
+        written += n;
       }
-      offset += result.size();
+      if(stopped)
+        break;
+      result.release();
     }
     if(debug)
-      fprintf(stderr, "DEBUG: %s complete\n", __func__);
+      fprintf(stderr,
+              "DEBUG: %s complete, window %zu bytes (rtt %.1fms, rate %.0f "
+              "bytes/s%s)\n",
+              __func__, window.size(), window.rtt() * 1000, window.rate(),
+              window.starting() ? ", slow start" : "");
   } catch(std::runtime_error &e) {
     fprintf(stderr, "ERROR: %s\n", e.what());
   }
-  // Reap any remaining reads
-  while(ids.size() > 0) {
+  // Make sure any remaining reads have actually been sent. There is no
+  // need to wait for them: their results are discarded when they arrive.
+  for(auto &lane : lanes) {
     try {
-      id = ids.front();
-      ids.pop_front();
-      conn->finish_read(id);
+      lane.conn->flush();
     } catch(std::runtime_error &e) {
       // Ignore any errors
     }
   }
-  // We own the local and remote file descriptors.
+  for(auto &r : requests)
+    lanes[r.lane].conn->abandon(r.id);
+  requests.clear();
+  // We own the local and remote file descriptors. There is no need to
+  // wait for the remote handles to be closed.
   close(fd);
-  conn->close(handle);
+  for(auto &lane : lanes) {
+    lane.conn->scheduler().remove(lane.stream);
+    try {
+      lane.conn->close_detached(lane.handle);
+    } catch(std::runtime_error &e) {
+      // Ignore any errors
+    }
+  }
 }
+#endif
 
 void Comparison::drain_fds() {
   if(debug)
@@ -285,9 +1392,20 @@ void Comparison::drain_fds() {
 void Comparison::join_threads() {
   if(debug)
     fprintf(stderr, "DEBUG: %s\n", __func__);
+  spools.clear();
   for(auto &t : threads)
-    t.join();
+    if(t.joinable())
+      t.join();
   threads.clear();
+  for(auto &f : feeders)
+#if HAVE_COROUTINES
+    f.wait();
+#else
+    f->wait();
+#endif
+  feeders.clear();
+  // The pipes are closed at both ends by now
+  pipes.clear();
 }
 
 int Comparison::run_diff(std::vector<std::string> &args) {
@@ -365,3 +1483,65 @@ int Comparison::run_diff(std::vector<std::string> &args) {
   }
   return WEXITSTATUS(status);
 }
+
+int Comparison::run_cmp(const std::vector<std::string> &args,
+                        const std::string &f1, const std::string &f2) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s\n", __func__);
+  const std::string &name1 = args[args.size() - 2], &name2 = args.back();
+  int fd1 = open(name1.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd1 < 0)
+    syserror(f1);
+  int fd2 = open(name2.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd2 < 0) {
+    int save_errno = errno;
+    close(fd1);
+    syserror(f2, save_errno);
+  }
+  // memcmp is vectorized already, so the chunk size just needs to amortize
+  // the system calls.
+  const size_t chunk = 256 * 1024;
+  std::vector<char> buffer1(chunk), buffer2(chunk);
+  uint64_t offset = 0;
+  bool same;
+  for(;;) {
+    ssize_t n1 = readall(fd1, &buffer1[0], chunk);
+    if(n1 < 0) {
+      int save_errno = errno;
+      close(fd1);
+      close(fd2);
+      syserror(f1, save_errno);
+    }
+    ssize_t n2 = readall(fd2, &buffer2[0], chunk);
+    if(n2 < 0) {
+      int save_errno = errno;
+      close(fd1);
+      close(fd2);
+      syserror(f2, save_errno);
+    }
+    // A short read means end of file
+    if(n1 != n2 || memcmp(&buffer1[0], &buffer2[0], n1) != 0) {
+      same = false;
+      break;
+    }
+    if(n1 == 0) {
+      same = true;
+      break;
+    }
+    offset += n1;
+  }
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s after %" PRIu64 " bytes\n", __func__,
+            same ? "identical" : "differ", offset);
+  close(fd1);
+  close(fd2);
+  if(!same)
+    printf("Files %s and %s differ\n", f1.c_str(), f2.c_str());
+  else if(flags & REPORT_IDENTICAL)
+    printf("Files %s and %s are identical\n", f1.c_str(), f2.c_str());
+  if(ferror(stdout)) {
+    fprintf(stderr, "ERROR: writing to stdout: %s\n", strerror(errno));
+    exit(2);
+  }
+  return same ? 0 : 1;
+}
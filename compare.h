@@ -25,12 +25,17 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <thread>
+#include <functional>
+#include <future>
 #include <regex>
-
-namespace SFTP {
-class Connection;
-}
+#include "sftp.h"
+#include "eventloop.h"
+#include "pipewriter.h"
+#if HAVE_COROUTINES
+#include "task.h"
+#endif
 
 /** @brief Context for a comparison
  */
@@ -60,9 +65,62 @@ public:
    * - @ref NEW_AS_EMPTY_1: if the first file is missing, treat as empty
    * - @ref NEW_AS_EMPTY_2: if the second file is missing, treat as empty
    * - @ref REPORT_IDENTICAL: report identical files
+   * - @ref NORMALIZE: diff options may equate files with different contents
    */
   unsigned flags;
 
+  /** @brief Minimum read window for remote files, in bytes */
+  size_t min_window = 16384;
+
+  /** @brief Maximum read window for remote files, in bytes */
+  size_t max_window = 16 * 1024 * 1024;
+
+  /** @brief Maximum data to hold for each remote file, in bytes
+   *
+   * This covers both reads in flight and data waiting to be written to
+   * diff, so reads can continue while diff is busy with the other file.
+   */
+  size_t buffer_limit = 64 * 1024 * 1024;
+
+  /** @brief Largest remote file to spool into memory, in bytes
+   *
+   * Remote files up to this size are copied into an in-memory file before
+   * diff starts, so that diff sees a regular file rather than a pipe. 0
+   * disables spooling.
+   */
+  uint64_t spool_limit = 32 * 1024 * 1024;
+
+  /** @brief Ask remote hosts for digests before transferring files
+   *
+   * If the digests of the two files match, neither is transferred.
+   */
+  bool remote_hash = false;
+
+  /** @brief Fetch only the changed blocks of large remote files
+   *
+   * When a large remote file is compared with a local file, the remote host
+   * checksums its blocks with <tt>remdiff --block-sums</tt>. Blocks found in
+   * the local file are copied from it, and only the rest are fetched. If
+   * the remote host cannot provide checksums the whole file is fetched.
+   */
+  bool delta = false;
+
+  /** @brief Number of SFTP connections to open to each host
+   *
+   * Reads from each remote file are striped across all the connections.
+   */
+  size_t connections = 1;
+
+  /** @brief How to reach remote hosts */
+  SFTP::Transport transport;
+
+  /** @brief Drive all remote I/O from a single event loop thread
+   *
+   * If this is @c false, each connection and each remote file has a thread
+   * of its own.
+   */
+  bool event_loop = false;
+
 private:
   /** @brief Substitution rule for replacing filenames in output */
   struct Replacement {
@@ -78,25 +136,199 @@ private:
     };
   };
 
+  /** @brief Event loop, if @ref event_loop is set */
+  std::unique_ptr<EventLoop> loop;
+
   /** @brief Hostnames to SFTP connections */
-  std::map<std::string, SFTP::Connection *> conns;
+  std::map<std::string, std::vector<SFTP::Connection *>> conns;
+
+  /** @brief One connection's view of a remote file */
+  struct Lane {
+    /** @brief SFTP connection */
+    SFTP::Connection *conn;
+
+    /** @brief Handle for the file on @ref conn */
+    std::string handle;
+
+    /** @brief Stream ID in @ref conn's scheduler */
+    unsigned stream;
+
+    /** @brief Test whether the lane may issue another read
+     * @param demand Bytes the lane would like in flight
+     * @return @c true if its fair share of @ref conn allows another read
+     */
+    bool credit(size_t demand) const;
+  };
+
+  /** @brief A file being added to the comparison */
+  struct File {
+    /** @brief Filename as given by the user */
+    std::string name;
+
+    /** @brief File number (1 for old, 2 for new) */
+    int fileno;
+
+    /** @brief True if the file is remote */
+    bool remote = false;
+
+    /** @brief Remote path */
+    std::string path;
+
+    /** @brief Connections for the file */
+    std::vector<SFTP::Connection *> conns;
+
+    /** @brief Outstanding open requests, one per connection */
+    std::vector<std::future<std::string>> opens;
+
+    /** @brief Outstanding stat request */
+    std::future<SFTP::Attributes> attrs;
+
+    /** @brief Connections and handles for an open remote file */
+    std::vector<Lane> lanes;
+
+    /** @brief True if the file is missing and treated as empty */
+    bool missing = false;
+
+    /** @brief True if @ref size is known */
+    bool sized = false;
+
+    /** @brief Size of a regular file */
+    uint64_t size = 0;
+
+    /** @brief Writer feeding the file's spool, if it is spooled */
+    PipeWriter *spool = nullptr;
+
+    /** @brief Local copy of the file rebuilt by @ref delta_fetch, or -1 */
+    int rebuilt = -1;
+  };
+
 
   /** @brief Background threads */
   std::vector<std::thread> threads;
 
+#if HAVE_COROUTINES
+  /** @brief Completion of event-driven feeders */
+  std::vector<std::future<void>> feeders;
+#else
+  /** @brief Event-driven equivalent of @ref feed_file */
+  class Feeder;
+
+  /** @brief Event-driven feeders */
+  std::vector<std::shared_ptr<Feeder>> feeders;
+#endif
+
+  /** @brief Writers for pipes to diff
+   *
+   * These must outlive both ends of their pipes.
+   */
+  std::vector<std::unique_ptr<PipeWriter>> pipes;
+
+  /** @brief Waits for spooled files to be complete */
+  std::vector<std::function<void()>> spools;
+
   /** @brief File descriptors to drain */
   std::vector<int> fds;
 
   /** @brief Sequence of replacements to execute on each line */
   std::vector<Replacement> replacements;
 
+  /** @brief Start adding a file
+   * @param file File to add
+   *
+   * For a remote file, this connects to the host and sends the open and
+   * stat requests without waiting for their replies, so that the
+   * round trips for both files overlap.
+   */
+  void start_file(File &file);
+
+  /** @brief Find out about a file
+   * @param file File, as passed to @ref start_file
+   *
+   * For a remote file, this collects the open and stat replies. Raises an
+   * exception if the file cannot be compared.
+   */
+  void collect_file(File &file);
+
+  /** @brief Close a file that will not be compared after all
+   * @param file File, as passed to @ref collect_file
+   */
+  void discard_file(File &file);
+
+  /** @brief Test whether files are compared byte for byte
+   * @return @c true if in brief mode with no option that could make
+   * different files compare equal
+   *
+   * Such comparisons are done without running diff.
+   */
+  bool exact() const;
+
+  /** @brief Test whether the sizes of the files can decide the comparison
+   * @param file1 First file, as passed to @ref collect_file
+   * @param file2 Second file, as passed to @ref collect_file
+   * @return @c true if the files are known to differ
+   *
+   * This is only possible for an @ref exact comparison.
+   */
+  bool sizes_differ(const File &file1, const File &file2) const;
+
+  /** @brief Test whether identical files can be recognized without diff
+   * @return @c true if diff would output nothing for identical files,
+   * except perhaps the @ref REPORT_IDENTICAL message
+   */
+  bool skippable() const;
+
+  /** @brief Get the digest of a file's complete contents
+   * @param file File, as passed to @ref add_file
+   * @param digest Where to store the digest
+   * @return @c true if @p digest was set
+   *
+   * This is possible for missing files, spooled remote files and local
+   * regular files up to @ref spool_limit. Local files are read here;
+   * remote files were hashed as they were spooled.
+   */
+  bool get_digest(const File &file, std::string &digest);
+
+  /** @brief Test whether files are known to be identical
+   * @param file1 First file, as passed to @ref add_file
+   * @param file2 Second file, as passed to @ref add_file
+   * @return @c true if the files are identical and diff need not run
+   *
+   * Spooled files must be complete.
+   */
+  bool identical(const File &file1, const File &file2);
+
+  /** @brief Test whether digests show that files are identical
+   * @param file1 First file, as passed to @ref collect_file
+   * @param file2 Second file, as passed to @ref collect_file
+   * @return @c true if the files are identical and need not be transferred
+   *
+   * Remote hosts are asked for the digests of remote files, and local files
+   * are read in full. See @ref remote_hash.
+   */
+  bool digests_match(const File &file1, const File &file2);
+
+  /** @brief Rebuild a remote file from the blocks of a local file
+   * @param remote Remote file, as passed to @ref collect_file
+   * @param local Local file, as passed to @ref collect_file
+   *
+   * On success, @c remote.rebuilt is set to a temporary file holding the
+   * remote file's contents. Otherwise the remote file is left to be
+   * transferred in full. See @ref delta.
+   */
+  void delta_fetch(File &remote, const File &local);
+
+  /** @brief Report identical files
+   * @param f1 First filename
+   * @param f2 Second filename
+   * @return diff status
+   */
+  int report_identical(const std::string &f1, const std::string &f2);
+
   /** @brief Add a file, either directly or replacing it with a pipe
-   * @brief f Filename
-   * @brief args Argument list to update
-   * @brief fileno File number (1 for old, 2 for new)
+   * @param file File to add, as passed to @ref collect_file
+   * @param args Argument list to update
    */
-  void add_file(const std::string &f, std::vector<std::string> &args,
-                int fileno);
+  void add_file(File &file, std::vector<std::string> &args);
 
   /** @brief Run the diff command
    * @param args Argument list
@@ -104,21 +336,59 @@ private:
    */
   int run_diff(std::vector<std::string> &args);
 
+  /** @brief Compare two files byte for byte, without diff
+   * @param args Argument list, ending with the files to read
+   * @param f1 First filename, for the report
+   * @param f2 Second filename, for the report
+   * @return diff status
+   *
+   * The files are read in step and the comparison stops at the first
+   * difference. Closing the pipes then stops the feeders, which abandon
+   * their outstanding reads.
+   */
+  int run_cmp(const std::vector<std::string> &args, const std::string &f1,
+              const std::string &f2);
+
   /** @brief Background thread to feed a file to a pipe
-   * @param conn SFTP Connection
+   * @param lanes Connections and handles for the file
    * @param context Context string for diagnostics
-   * @param handle SFTP handle
    * @param fd Output file descriptor
+   * @param pipe Writer for @p fd
+   *
+   * The handles in @p lanes and @p fd will be closed.
+   *
+   * Successive reads are distributed round-robin across @p lanes and
+   * written to @p fd in order, by a separate thread so that reads continue
+   * while @p fd is full.
    *
-   * @p handle and @p fd will be closed.
+   * The number of bytes kept in flight is governed by a @ref ReadWindow
+   * bounded by @ref min_window and @ref max_window. Reads and data waiting
+   * to be written are together limited to @ref buffer_limit.
    */
-  static void feed_file(SFTP::Connection *conn, std::string context,
-                        std::string handle, int fd);
+  void feed_file(std::vector<Lane> lanes, std::string context, int fd,
+                 PipeWriter *pipe);
+
+#if HAVE_COROUTINES
+  /** @brief Coroutine to feed a file to a pipe
+   * @param lanes Connections and handles for the file
+   * @param context Context string for diagnostics
+   * @param fd Output file descriptor (non-blocking)
+   * @param pipe Writer for @p fd
+   * @param read_templates Read template for each lane
+   *
+   * This is the event-driven equivalent of @ref feed_file, and behaves in
+   * the same way. It runs in the event loop thread.
+   */
+  Coro::Task<void>
+  feed_task(std::vector<Lane> lanes, std::string context, int fd,
+            PipeWriter *pipe,
+            std::vector<SFTP::Connection::ReadTemplate> read_templates);
+#endif
 
   /** @brief Drain and close internal file descriptors */
   void drain_fds();
 
-  /** @brief Join any outstanding threads */
+  /** @brief Join any outstanding threads and feeders */
   void join_threads();
 };
 
@@ -0,0 +1,153 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "delta.h"
+#include "misc.h"
+#include "sha256.h"
+#include <cerrno>
+#include <cinttypes>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
+
+/** @brief First line of the output of @ref write_block_sums */
+#define BLOCK_SUMS_HEADER "remdiff-block-sums 1"
+
+RollingChecksum::RollingChecksum(const uint8_t *data, size_t n) : window(n) {
+  for(size_t i = 0; i < n; ++i) {
+    a += data[i];
+    b += (n - i) * data[i];
+  }
+}
+
+bool BlockSums::parse(const std::string &text) {
+  std::istringstream input(text);
+  std::string line;
+  if(!std::getline(input, line) || line != BLOCK_SUMS_HEADER)
+    return false;
+  if(!(input >> block) || block == 0)
+    return false;
+  weak.clear();
+  strong.clear();
+  std::string word;
+  while(input >> word && word != "end") {
+    std::string digest;
+    if(word.size() != 8 || !(input >> digest) || digest.size() != 64)
+      return false;
+    weak.push_back(strtoul(word.c_str(), nullptr, 16));
+    strong.push_back(digest);
+  }
+  if(word != "end" || !(input >> size))
+    return false;
+  // Every block must be accounted for
+  return weak.size() == (size + block - 1) / block;
+}
+
+bool BlockSums::verify(size_t n, const void *data, size_t len) const {
+  if(n >= strong.size() || len != std::min((uint64_t)block, size - n * block))
+    return false;
+  Sha256 hash;
+  hash.update(data, len);
+  return hash.finish() == strong[n];
+}
+
+size_t choose_block_size(uint64_t size, size_t largest) {
+  size_t block = 4096;
+  while((uint64_t)block * block < size && block < 1024 * 1024
+        && block * 2 <= largest)
+    block *= 2;
+  return block;
+}
+
+int write_block_sums(int fd, size_t block, FILE *output) {
+  std::vector<char> buffer(block);
+  uint64_t size = 0;
+  fprintf(output, "%s\n%zu\n", BLOCK_SUMS_HEADER, block);
+  ssize_t n;
+  while((n = readall(fd, &buffer[0], block)) > 0) {
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(&buffer[0]);
+    Sha256 hash;
+    hash.update(data, n);
+    fprintf(output, "%08" PRIx32 " %s\n", RollingChecksum(data, n).value(),
+            hash.finish().c_str());
+    size += n;
+  }
+  if(n < 0) {
+    fprintf(stderr, "ERROR: read: %s\n", strerror(errno));
+    return 2;
+  }
+  fprintf(output, "end %" PRIu64 "\n", size);
+  if(fflush(output) < 0 || ferror(output)) {
+    fprintf(stderr, "ERROR: writing output: %s\n", strerror(errno));
+    return 2;
+  }
+  return 0;
+}
+
+std::vector<int64_t> match_blocks(const BlockSums &sums, const uint8_t *data,
+                                  uint64_t size) {
+  const size_t block = sums.block;
+  std::vector<int64_t> found(sums.weak.size(), -1);
+  // Index the complete blocks by weak checksum
+  size_t complete = sums.size / block, remaining = complete;
+  std::unordered_map<uint32_t, std::vector<size_t>> index;
+  for(size_t n = 0; n < complete; ++n)
+    index[sums.weak[n]].push_back(n);
+  if(size < block || remaining == 0)
+    return found;
+  uint64_t pos = 0;
+  RollingChecksum sum(data, block);
+  for(;;) {
+    bool matched = false;
+    auto it = index.find(sum.value());
+    if(it != index.end()) {
+      // Only compute the strong checksum if a block still needs it. The same
+      // block may appear more than once in the remote file.
+      std::string strong;
+      for(size_t n : it->second) {
+        if(found[n] >= 0)
+          continue;
+        if(strong.empty()) {
+          Sha256 hash;
+          hash.update(data + pos, block);
+          strong = hash.finish();
+        }
+        if(strong == sums.strong[n]) {
+          found[n] = pos;
+          --remaining;
+          matched = true;
+        }
+      }
+    }
+    if(remaining == 0)
+      break;
+    if(matched) {
+      // Look for the next block after this one
+      pos += block;
+      if(pos + block > size)
+        break;
+      sum = RollingChecksum(data + pos, block);
+    } else {
+      if(pos + block >= size)
+        break;
+      sum.roll(data[pos], data[pos + block]);
+      ++pos;
+    }
+  }
+  return found;
+}
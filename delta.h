@@ -0,0 +1,137 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+/** @file delta.h
+ * @brief Block checksums for fetching only the changed parts of files
+ *
+ * This is the rsync algorithm with the roles rearranged. The remote host
+ * runs <tt>remdiff --block-sums</tt> to checksum each fixed-size block of
+ * its file (see @ref write_block_sums). The local side slides a window
+ * over its own file looking for those blocks (see @ref match_blocks), so
+ * only the blocks it lacks need to be fetched.
+ */
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/** @brief Rolling checksum of a window of data
+ *
+ * This is the weak checksum used by rsync. It can be moved along by a byte
+ * in constant time.
+ */
+class RollingChecksum {
+public:
+  /** @brief Compute the checksum of a window
+   * @param data Start of window
+   * @param n Size of window
+   */
+  RollingChecksum(const uint8_t *data, size_t n);
+
+  /** @brief Move the window along by one byte
+   * @param out Byte leaving the window
+   * @param in Byte entering the window
+   */
+  void roll(uint8_t out, uint8_t in) {
+    a += in - out;
+    b += a - window * out;
+  }
+
+  /** @brief Return the checksum */
+  uint32_t value() const {
+    return (a & 0xFFFF) | (b << 16);
+  }
+
+private:
+  /** @brief Window size */
+  uint32_t window;
+
+  /** @brief Sum of bytes */
+  uint32_t a = 0;
+
+  /** @brief Sum of bytes weighted by distance from the end of the window */
+  uint32_t b = 0;
+};
+
+/** @brief Checksums of the blocks of a file */
+struct BlockSums {
+  /** @brief Block size */
+  size_t block = 0;
+
+  /** @brief Size of the file */
+  uint64_t size = 0;
+
+  /** @brief Rolling checksum of each block */
+  std::vector<uint32_t> weak;
+
+  /** @brief SHA-256 digest of each block, in hex */
+  std::vector<std::string> strong;
+
+  /** @brief Test whether data matches a block
+   * @param n Block number
+   * @param data Data
+   * @param len Length of data
+   * @return @c true if the data has block @p n's length and strong checksum
+   */
+  bool verify(size_t n, const void *data, size_t len) const;
+
+  /** @brief Parse the output of @ref write_block_sums
+   * @param text Output to parse
+   * @return @c true on success, @c false if @p text is malformed
+   */
+  bool parse(const std::string &text);
+};
+
+/** @brief Choose a block size for a file
+ * @param size Size of file
+ * @param largest Largest acceptable block size
+ * @return Block size
+ *
+ * As in rsync, the block size grows with the square root of the file size,
+ * balancing the size of the checksums against the data fetched for each
+ * changed block.
+ */
+size_t choose_block_size(uint64_t size, size_t largest);
+
+/** @brief Write the checksums of the blocks of a file
+ * @param fd File to read
+ * @param block Block size
+ * @param output Where to write the checksums
+ * @return Exit status
+ *
+ * This implements <tt>remdiff --block-sums</tt>.
+ */
+int write_block_sums(int fd, size_t block, FILE *output);
+
+/** @brief Find blocks of a remote file in a local file
+ * @param sums Checksums of the remote file
+ * @param data Contents of the local file
+ * @param size Size of the local file
+ * @return Offset of each remote block in the local file, or -1 if it was not
+ * found
+ *
+ * A final partial block is never found.
+ */
+std::vector<int64_t> match_blocks(const BlockSums &sums, const uint8_t *data,
+                                  uint64_t size);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "eventloop.h"
+#include "misc.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_EVENTFD_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define EVENTLOOP_SUPPORTED 1
+#else
+#define EVENTLOOP_SUPPORTED 0
+#endif
+
+/** @brief Maximum number of events to collect at once */
+#define MAX_EVENTS 64
+
+bool EventLoop::supported() {
+  return EVENTLOOP_SUPPORTED;
+}
+
+#if EVENTLOOP_SUPPORTED
+
+EventLoop::EventLoop() {
+  if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    syserror("epoll_create1");
+  if((wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+    ::close(epfd);
+    syserror("eventfd");
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = wakefd;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+    ::close(epfd);
+    ::close(wakefd);
+    syserror("epoll_ctl");
+  }
+}
+
+EventLoop::~EventLoop() {
+  if(thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> g(lock);
+      quit = true;
+    }
+    wake();
+    thread.join();
+  }
+  ::close(epfd);
+  ::close(wakefd);
+}
+
+void EventLoop::watch(int fd, unsigned events, Handler handler) {
+  std::lock_guard<std::mutex> g(lock);
+  start();
+  struct epoll_event ev;
+  ev.events = 0;
+  if(events & READ)
+    ev.events |= EPOLLIN;
+  if(events & WRITE)
+    ev.events |= EPOLLOUT;
+  ev.data.fd = fd;
+  bool existing = handlers.find(fd) != handlers.end();
+  if(epoll_ctl(epfd, existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+    syserror("epoll_ctl");
+  handlers[fd] = std::make_shared<Handler>(std::move(handler));
+}
+
+void EventLoop::unwatch(int fd) {
+  std::unique_lock<std::mutex> locked(lock);
+  if(handlers.erase(fd) == 0)
+    return;
+  // The descriptor may already have been closed, in which case the kernel
+  // has forgotten it.
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  if(!in_loop())
+    while(dispatching == fd)
+      dispatched.wait(locked);
+}
+
+void EventLoop::post(std::function<void()> f) {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    start();
+    posted.push_back(std::move(f));
+  }
+  wake();
+}
+
+bool EventLoop::in_loop() const {
+  return std::this_thread::get_id() == thread.get_id();
+}
+
+void EventLoop::start() {
+  if(!thread.joinable())
+    thread = std::thread(&EventLoop::run, this);
+}
+
+void EventLoop::wake() {
+  uint64_t one = 1;
+  // If the counter is saturated then the loop will wake anyway.
+  if(::write(wakefd, &one, sizeof one) < 0 && errno != EAGAIN)
+    syserror("eventfd write");
+}
+
+void EventLoop::run() {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s starting\n", __func__);
+  struct epoll_event events[MAX_EVENTS];
+  std::vector<std::function<void()>> work;
+  for(;;) {
+    // Run any functions posted from other threads
+    {
+      std::lock_guard<std::mutex> g(lock);
+      if(quit)
+        break;
+      work.swap(posted);
+    }
+    for(auto &f : work) {
+      try {
+        f();
+      } catch(std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+      }
+    }
+    work.clear();
+    // Wait for something to happen
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "ERROR: epoll_wait: %s\n", strerror(errno));
+      abort();
+    }
+    for(int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if(fd == wakefd) {
+        uint64_t count;
+        if(::read(wakefd, &count, sizeof count) < 0 && errno != EAGAIN) {
+          fprintf(stderr, "ERROR: eventfd read: %s\n", strerror(errno));
+          abort();
+        }
+        continue;
+      }
+      std::shared_ptr<Handler> handler;
+      {
+        std::lock_guard<std::mutex> g(lock);
+        auto it = handlers.find(fd);
+        // It might have been unwatched since epoll_wait returned
+        if(it == handlers.end())
+          continue;
+        handler = it->second;
+        dispatching = fd;
+      }
+      unsigned happened = 0;
+      if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        happened |= READ;
+      if(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        happened |= WRITE;
+      try {
+        (*handler)(happened);
+      } catch(std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+      }
+      {
+        std::lock_guard<std::mutex> g(lock);
+        dispatching = -1;
+      }
+      dispatched.notify_all();
+    }
+  }
+  if(debug)
+    fprintf(stderr, "DEBUG: %s quit\n", __func__);
+}
+
+#else
+
+EventLoop::EventLoop() {
+  throw std::runtime_error("event loop not supported on this platform");
+}
+
+EventLoop::~EventLoop() {}
+
+void EventLoop::watch(int, unsigned, Handler) {}
+
+void EventLoop::unwatch(int) {}
+
+void EventLoop::post(std::function<void()>) {}
+
+bool EventLoop::in_loop() const {
+  return false;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+/** @file eventloop.h
+ * @brief Single-threaded I/O event loop
+ */
+
+#include <config.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+/** @brief An I/O event loop
+ *
+ * The loop runs in a single background thread, which waits for file
+ * descriptors to become ready with @c epoll and calls the handlers
+ * registered for them. Handlers must not block.
+ *
+ * File descriptors may be watched and unwatched from any thread.
+ *
+ * This is only available if the platform has @c epoll; see @ref
+ * supported.
+ */
+class EventLoop {
+public:
+  /** @brief Events that may be watched for */
+  enum Event : unsigned {
+    /** @brief File descriptor is readable */
+    READ = 1,
+    /** @brief File descriptor is writable */
+    WRITE = 2,
+  };
+
+  /** @brief Handler for a file descriptor
+   *
+   * The argument is the set of events that occurred. Errors and hangups
+   * are reported as both @ref READ and @ref WRITE, so that the handler
+   * discovers them when it next does I/O.
+   */
+  typedef std::function<void(unsigned)> Handler;
+
+  /** @brief Construct an event loop
+   *
+   * The background thread is started by the first call to @ref watch or
+   * @ref post.
+   */
+  EventLoop();
+
+  /** @brief Stop and destroy an event loop */
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  /** @brief Return @c true if event loops are supported on this platform */
+  static bool supported();
+
+  /** @brief Watch a file descriptor
+   * @param fd File descriptor
+   * @param events Events of interest, e.g. @ref READ
+   * @param handler Handler to call when an event occurs
+   *
+   * If @p fd is already watched, its events and handler are replaced.
+   */
+  void watch(int fd, unsigned events, Handler handler);
+
+  /** @brief Stop watching a file descriptor
+   * @param fd File descriptor
+   *
+   * When called outside the loop thread, this waits for any call to the
+   * handler for @p fd that is in progress to return, so afterwards the
+   * handler's resources may be safely destroyed.
+   */
+  void unwatch(int fd);
+
+  /** @brief Call a function in the loop thread
+   * @param f Function to call
+   */
+  void post(std::function<void()> f);
+
+  /** @brief Return @c true if called from the loop thread */
+  bool in_loop() const;
+
+private:
+  /** @brief @c epoll file descriptor */
+  int epfd = -1;
+
+  /** @brief @c eventfd used to wake the loop thread */
+  int wakefd = -1;
+
+  /** @brief Lock protecting later fields */
+  std::mutex lock;
+
+  /** @brief Signalled when a handler returns */
+  std::condition_variable dispatched;
+
+  /** @brief Handlers for watched file descriptors */
+  std::map<int, std::shared_ptr<Handler>> handlers;
+
+  /** @brief Functions waiting to be called in the loop thread */
+  std::vector<std::function<void()>> posted;
+
+  /** @brief File descriptor whose handler is running, or -1 */
+  int dispatching = -1;
+
+  /** @brief Set to stop the loop thread */
+  bool quit = false;
+
+  /** @brief The loop thread */
+  std::thread thread;
+
+  /** @brief Start the loop thread if it is not running
+   *
+   * Must be called with @c lock held.
+   */
+  void start();
+
+  /** @brief Wake the loop thread */
+  void wake();
+
+  /** @brief Loop thread */
+  void run();
+};
+
+#endif
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <system_error>
 
@@ -32,6 +33,14 @@ void close_on_exec(int fd) {
     syserror("fcntl");
 }
 
+void nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0)
+    syserror("fcntl");
+  if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    syserror("fcntl");
+}
+
 ssize_t writeall(int fd, const char *buffer, size_t n) {
   size_t written = 0;
 
@@ -47,6 +56,59 @@ ssize_t writeall(int fd, const char *buffer, size_t n) {
   return written;
 }
 
+ssize_t readall(int fd, char *buffer, size_t n) {
+  size_t bytes_read = 0;
+
+  while(bytes_read < n) {
+    ssize_t this_read = ::read(fd, buffer + bytes_read, n - bytes_read);
+    if(this_read < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    if(this_read == 0)
+      break;
+    bytes_read += this_read;
+  }
+  return bytes_read;
+}
+
+uint64_t parse_size(const std::string &s) {
+  const char *start = s.c_str();
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(start, &end, 10);
+  if(errno || end == start || *start == '-')
+    throw std::runtime_error("invalid size: " + s);
+  unsigned shift = 0;
+  switch(*end) {
+  case 'k':
+  case 'K': shift = 10; break;
+  case 'm':
+  case 'M': shift = 20; break;
+  case 'g':
+  case 'G': shift = 30; break;
+  case 0: break;
+  default: throw std::runtime_error("invalid size: " + s);
+  }
+  if(shift && *++end)
+    throw std::runtime_error("invalid size: " + s);
+  if(n > (UINT64_MAX >> shift))
+    throw std::runtime_error("size too large: " + s);
+  return (uint64_t)n << shift;
+}
+
+std::string shell_quote(const std::string &s) {
+  std::string r = "'";
+  for(char ch : s) {
+    if(ch == '\'')
+      r += "'\\''";
+    else
+      r += ch;
+  }
+  return r + "'";
+}
+
 [[noreturn]] void syserror(const std::string &context, int errno_value) {
   if(debug)
     fprintf(stderr, "DEBUG: %s: %s\n", context.c_str(),
@@ -26,6 +26,8 @@
 #include <stdexcept>
 #include <system_error>
 #include <cstring>
+#include <cstdint>
+#include <string>
 
 /** @brief Set to enable debug output */
 extern bool debug;
@@ -35,6 +37,11 @@ extern bool debug;
  * */
 void close_on_exec(int fd);
 
+/** @brief Make @p fd non-blocking
+ * @param fd File descriptor reconfigure
+ */
+void nonblock(int fd);
+
 /** @brief Interrupt-safe wrapper for @c write()
  * @param fd File descriptor to write to
  * @param buffer Buffer to write
@@ -43,6 +50,31 @@ void close_on_exec(int fd);
  */
 ssize_t writeall(int fd, const char *buffer, size_t n);
 
+/** @brief Interrupt-safe wrapper for @c read()
+ * @param fd File descriptor to read from
+ * @param buffer Buffer for bytes read
+ * @param n Number of bytes to read
+ * @return Number of bytes read, or -1 on error
+ *
+ * The return value will only be less than @p n at end of file.
+ */
+ssize_t readall(int fd, char *buffer, size_t n);
+
+/** @brief Parse a size argument
+ * @param s String to parse
+ * @return Size in bytes
+ *
+ * @p s may have a suffix of @c K, @c M or @c G. Raises @c
+ * std::runtime_error if @p s is not a valid size.
+ */
+uint64_t parse_size(const std::string &s);
+
+/** @brief Quote a string for the shell
+ * @param s String to quote
+ * @return Quoted string
+ */
+std::string shell_quote(const std::string &s);
+
 /** @brief Raise a @c std::system_error exception
  * @param context Message for diagnostic
  * @param errno_value Error code or 0 for none
@@ -0,0 +1,130 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pipewriter.h"
+#include "misc.h"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** @brief Preferred pipe size in bytes
+ *
+ * This is the default value of @c /proc/sys/fs/pipe-max-size on Linux.
+ */
+#define PIPE_SIZE (1024 * 1024)
+
+PipeWriter::PipeWriter(int fd) : fd(fd) {
+  // Anything other than a pipe just gets plain writes
+  struct stat sb;
+  if(fstat(fd, &sb) < 0)
+    syserror("fstat");
+  if(!S_ISFIFO(sb.st_mode))
+    return;
+#ifdef F_SETPIPE_SZ
+  // Failure just leaves the pipe at its default size.
+  int size = fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+  if(debug)
+    fprintf(stderr, "DEBUG: %s: pipe size %d\n", __func__,
+            size >= 0 ? size : fcntl(fd, F_GETPIPE_SZ));
+#endif
+#if HAVE_VMSPLICE && defined FIONREAD
+  int flags = fcntl(fd, F_GETFL);
+  if(flags < 0)
+    syserror("fcntl");
+  splice_flags = (flags & O_NONBLOCK) ? SPLICE_F_NONBLOCK : 0;
+#endif
+}
+
+ssize_t PipeWriter::write(Buffer &data, size_t done) {
+  ssize_t n;
+  for(;;) {
+#if HAVE_VMSPLICE && defined FIONREAD
+    if(splice_flags >= 0) {
+      struct iovec iov;
+      iov.iov_base = data.data() + done;
+      iov.iov_len = data.size() - done;
+      n = vmsplice(fd, &iov, 1, splice_flags);
+      if(n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // Not a pipe, or no kernel support
+        if(debug)
+          fprintf(stderr, "DEBUG: %s: vmsplice: %s\n", __func__,
+                  strerror(errno));
+        splice_flags = -1;
+        continue;
+      }
+      if(n > 0)
+        partial = true;
+    } else
+#endif
+      n = ::write(fd, data.data() + done, data.size() - done);
+    if(n >= 0 || errno != EINTR)
+      break;
+  }
+  if(n < 0)
+    return n;
+  if(hash)
+    hash->update(data.data() + done, n);
+  written += n;
+  if(done + n == data.size()) {
+    if(partial) {
+      // The pipe refers to this buffer's memory, so keep it until the
+      // reader has consumed it.
+      retained.push_back({ written, std::move(data) });
+      partial = false;
+    }
+  }
+  reap();
+  return n;
+}
+
+ssize_t PipeWriter::writeall(Buffer &data) {
+  size_t done = 0;
+  while(done < data.size()) {
+    ssize_t n = write(data, done);
+    if(n < 0)
+      return -1;
+    done += n;
+  }
+  ssize_t total = done;
+  data.release();
+  return total;
+}
+
+void PipeWriter::start_digest() {
+  hash.reset(new Sha256());
+}
+
+std::string PipeWriter::digest() {
+  return hash ? hash->finish() : std::string();
+}
+
+void PipeWriter::reap() {
+#ifdef FIONREAD
+  if(retained.empty())
+    return;
+  int queued;
+  if(ioctl(fd, FIONREAD, &queued) < 0)
+    return;
+  uint64_t consumed = written - queued;
+  while(!retained.empty() && retained.front().end <= consumed)
+    retained.pop_front();
+#endif
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PIPEWRITER_H
+#define PIPEWRITER_H
+/** @file pipewriter.h
+ * @brief Efficient writing of buffers to a pipe
+ */
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include "buffer.h"
+#include "sha256.h"
+
+/** @brief Writer for the pipes that feed @c diff
+ *
+ * Descriptors other than pipes are written to in the ordinary way.
+ *
+ * The pipe is enlarged as far as the system allows, reducing the number
+ * of wakeups on each side.
+ *
+ * Where possible data is handed to the pipe with @c vmsplice, so that it
+ * is not copied into the kernel. The pipe then refers to the buffer's
+ * memory, so the writer keeps each such buffer until the reader has
+ * consumed it. Otherwise, or if the platform does not support it, plain @c
+ * write is used.
+ *
+ * The pipe may still refer to retained buffers after its write end is
+ * closed. So the writer must not be destroyed until the read end has been
+ * closed too.
+ */
+class PipeWriter {
+public:
+  /** @brief Construct a pipe writer
+   * @param fd Write end of pipe
+   *
+   * If @p fd is to be non-blocking, that must be set before the writer is
+   * constructed.
+   */
+  PipeWriter(int fd);
+
+  PipeWriter(const PipeWriter &) = delete;
+  PipeWriter &operator=(const PipeWriter &) = delete;
+
+  /** @brief Write data to the pipe
+   * @param data Buffer to write
+   * @param done Number of bytes of @p data already written
+   * @return Number of bytes written, or -1 on error
+   *
+   * The semantics are as for @c write, except that interrupted writes are
+   * retried.
+   *
+   * Once some of @p data has been written, the caller must not modify it.
+   * If this call completes it, the writer may take ownership, leaving @p
+   * data empty.
+   */
+  ssize_t write(Buffer &data, size_t done);
+
+  /** @brief Write all of a buffer to a blocking pipe
+   * @param data Buffer to write
+   * @return Number of bytes written, or -1 on error
+   *
+   * Afterwards @p data is empty.
+   */
+  ssize_t writeall(Buffer &data);
+
+  /** @brief Compute a digest of everything written from now on */
+  void start_digest();
+
+  /** @brief Return the digest of everything written
+   * @return Digest in hex, or an empty string if @ref start_digest was not
+   * called
+   *
+   * Nothing more may be written afterwards.
+   */
+  std::string digest();
+
+private:
+  /** @brief A buffer that the pipe may still refer to */
+  struct Retained {
+    /** @brief Position in the stream of the end of @c data */
+    uint64_t end;
+
+    /** @brief Buffer */
+    Buffer data;
+  };
+
+  /** @brief File descriptor */
+  int fd;
+
+  /** @brief Flags for @c vmsplice, or -1 to use @c write */
+  int splice_flags = -1;
+
+  /** @brief Total bytes written so far */
+  uint64_t written = 0;
+
+  /** @brief Set when the current buffer has been partly spliced */
+  bool partial = false;
+
+  /** @brief Digest of the data written, if wanted */
+  std::unique_ptr<Sha256> hash;
+
+  /** @brief Buffers that the pipe may still refer to, oldest first */
+  std::deque<Retained> retained;
+
+  /** @brief Release buffers that the reader has consumed */
+  void reap();
+};
+
+#endif
@@ -18,7 +18,12 @@
 #include "remdiff.h"
 #include "compare.h"
 #include "misc.h"
+#include "agent.h"
+#include "budget.h"
+#include "delta.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
 #include <csignal>
 #include <getopt.h>
 
@@ -28,6 +33,9 @@ static int passthru_option_val = 2 * (UCHAR_MAX) + 1;
 /** @brief Option IDs to full option names */
 static std::map<int, std::string> passthru_option_map;
 
+/** @brief Option IDs to the comparison flags they imply */
+static std::map<int, unsigned> passthru_option_flags;
+
 /** @brief Help for passed-through options */
 static std::vector<std::string> passthru_help;
 
@@ -37,10 +45,11 @@ static std::vector<std::string> passthru_help;
  * @param val Short option name or -1 to allocate one
  * @param value If the option takes a value, the name of the value; otherwise @c
  * nullptr.
+ * @param flags Comparison flags implied by the option
  */
 static void passthru_option(std::vector<struct option> &longopts,
                             const char *name, int val,
-                            const char *value = nullptr) {
+                            const char *value = nullptr, unsigned flags = 0) {
   std::string help_string;
   // The full option name
   std::string opt = "--" + std::string(name);
@@ -64,6 +73,8 @@ static void passthru_option(std::vector<struct option> &longopts,
   longopts.push_back(option{ name, has_arg, nullptr, val });
   // Map the ID to the full option name
   passthru_option_map[val] = opt;
+  if(flags)
+    passthru_option_flags[val] = flags;
 }
 
 static void help() {
@@ -72,12 +83,27 @@ static void help() {
     "\n"
     "Usage:\n"
     "  remdiff [OPTIONS] [--] [HOST:]PATH [HOST:]PATH\n"
+    "  remdiff [OPTIONS] --agent\n"
     "Mode options:\n"
     "  --normal                   Traditional diff\n"
     "  -q, --brief                Report only when files differ\n"
     "  -u, -U NUM, --unified NUM  Unified diff (with NUM lines of context)\n"
     "  -y, --side-by-side         Side-by-side diff\n"
     "Other options:\n"
+    "  --min-window BYTES         Minimum read window for remote files\n"
+    "  --max-window BYTES         Maximum read window for remote files\n"
+    "  --buffer-limit BYTES       Memory to use for each remote file\n"
+    "  --spool-limit BYTES        Spool remote files up to this size\n"
+    "  --remote-hash              Skip transfers if remote digests match\n"
+    "  --delta                    Fetch only changed blocks of large files\n"
+    "  --max-memory BYTES         Memory to use for all remote files\n"
+    "  --connections N            Connections per host (default 1)\n"
+    "  --control-persist TIME     Share SSH connections across invocations\n"
+    "  --retries N                Reconnect up to N times (default 3)\n"
+    "  --sftp-command CMD         Run CMD as the SFTP server instead of ssh\n"
+    "  --agent                    Run an agent to hold SFTP connections open\n"
+    "  --no-agent                 Don't use a running agent\n"
+    "  --event-loop               Drive all remote I/O from one thread\n"
     "  --help                     Display usage message\n"
     "  --version                  Display version string\n"
     "Diff options supported:\n");
@@ -120,10 +146,41 @@ static void version() {
   printf("version %s tag %s\n", PACKAGE_VERSION, TAG);
 }
 
+/** @brief Parse a size option, exiting on error
+ * @param s Option value
+ * @return Size in bytes
+ */
+static size_t size_option(const char *s) {
+  try {
+    return parse_size(s);
+  } catch(std::runtime_error &e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    exit(2);
+  }
+}
+
+/** @brief Parse an integer option, exiting on error
+ * @param s Option value
+ * @param min Smallest acceptable value
+ * @return Value
+ */
+static size_t count_option(const char *s, size_t min = 1) {
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(s, &end, 10);
+  if(errno || end == s || *end || *s == '-' || n < min) {
+    fprintf(stderr, "ERROR: invalid count: %s\n", s);
+    exit(2);
+  }
+  return n;
+}
+
 int main(int argc, char **argv) {
   // Parse command line
   int n;
   Comparison c;
+  bool agent = false;
+  size_t block_sums = 0;
   std::string shortopts;
   std::vector<struct option> longopts{
     { "brief", no_argument, nullptr, 'q' },
@@ -137,6 +194,21 @@ int main(int argc, char **argv) {
     { "unified", required_argument, nullptr, 'U' },
     { "version", no_argument, nullptr, OPT_VERSION },
     { "debug", no_argument, nullptr, OPT_DEBUG },
+    { "min-window", required_argument, nullptr, OPT_MIN_WINDOW },
+    { "max-window", required_argument, nullptr, OPT_MAX_WINDOW },
+    { "buffer-limit", required_argument, nullptr, OPT_BUFFER_LIMIT },
+    { "spool-limit", required_argument, nullptr, OPT_SPOOL_LIMIT },
+    { "remote-hash", no_argument, nullptr, OPT_REMOTE_HASH },
+    { "delta", no_argument, nullptr, OPT_DELTA },
+    { "block-sums", required_argument, nullptr, OPT_BLOCK_SUMS },
+    { "max-memory", required_argument, nullptr, OPT_MAX_MEMORY },
+    { "connections", required_argument, nullptr, OPT_CONNECTIONS },
+    { "retries", required_argument, nullptr, OPT_RETRIES },
+    { "sftp-command", required_argument, nullptr, OPT_SFTP_COMMAND },
+    { "control-persist", required_argument, nullptr, OPT_CONTROL_PERSIST },
+    { "agent", no_argument, nullptr, OPT_AGENT },
+    { "no-agent", no_argument, nullptr, OPT_NO_AGENT },
+    { "event-loop", no_argument, nullptr, OPT_EVENT_LOOP },
   };
 
   // Fill in diff options that we don't document explicitly.
@@ -145,12 +217,12 @@ int main(int argc, char **argv) {
   passthru_option(longopts, "expand-tabs", 't');
   passthru_option(longopts, "horizon-lines", -1, "LINES");
   passthru_option(longopts, "ifdef", 'D', "NAME");
-  passthru_option(longopts, "ignore-all-space", 'w');
-  passthru_option(longopts, "ignore-blank-lines", 'B');
-  passthru_option(longopts, "ignore-case", 'i');
-  passthru_option(longopts, "ignore-tab-expansion", 'E');
-  passthru_option(longopts, "ignore-trailing-space", 'Z');
-  passthru_option(longopts, "ignore-space-change", 'b');
+  passthru_option(longopts, "ignore-all-space", 'w', nullptr, NORMALIZE);
+  passthru_option(longopts, "ignore-blank-lines", 'B', nullptr, NORMALIZE);
+  passthru_option(longopts, "ignore-case", 'i', nullptr, NORMALIZE);
+  passthru_option(longopts, "ignore-tab-expansion", 'E', nullptr, NORMALIZE);
+  passthru_option(longopts, "ignore-trailing-space", 'Z', nullptr, NORMALIZE);
+  passthru_option(longopts, "ignore-space-change", 'b', nullptr, NORMALIZE);
   passthru_option(longopts, "initial-tab", 'T');
   passthru_option(longopts, "left-column", -1);
   passthru_option(longopts, "minimal", 'd');
@@ -159,12 +231,12 @@ int main(int argc, char **argv) {
   passthru_help.push_back("-s, --report-identical-files");
   passthru_option(longopts, "show-c-function", 'p');
   passthru_option(longopts, "speed-large-files", -1);
-  passthru_option(longopts, "strip-trailing-cr", -1);
+  passthru_option(longopts, "strip-trailing-cr", -1, nullptr, NORMALIZE);
   passthru_option(longopts, "suppress-common-lines", -1);
   passthru_option(longopts, "suppress-blank-empty", -1);
   passthru_option(longopts, "tabsize", -1, "SIZE");
   passthru_help.push_back("    --unidirectional-new-file");
-  passthru_option(longopts, "width", 'w', "WIDTH");
+  passthru_option(longopts, "width", 'W', "WIDTH");
 
   // Terminate the long options list
   longopts.push_back(option{ nullptr, 0, nullptr, 0 });
@@ -207,9 +279,46 @@ int main(int argc, char **argv) {
     case 'y': c.mode = 'y'; break;
     case OPT_VERSION: version(); return 0;
     case OPT_DEBUG: debug = true; break;
+    case OPT_MIN_WINDOW: c.min_window = size_option(optarg); break;
+    case OPT_MAX_WINDOW:
+      if((c.max_window = size_option(optarg)) == 0) {
+        fprintf(stderr, "ERROR: --max-window must be positive\n");
+        return 2;
+      }
+      break;
+    case OPT_BUFFER_LIMIT:
+      if((c.buffer_limit = size_option(optarg)) == 0) {
+        fprintf(stderr, "ERROR: --buffer-limit must be positive\n");
+        return 2;
+      }
+      break;
+    case OPT_SPOOL_LIMIT: c.spool_limit = size_option(optarg); break;
+    case OPT_REMOTE_HASH: c.remote_hash = true; break;
+    case OPT_DELTA: c.delta = true; break;
+    case OPT_BLOCK_SUMS:
+      if((block_sums = size_option(optarg)) == 0) {
+        fprintf(stderr, "ERROR: --block-sums must be positive\n");
+        return 2;
+      }
+      break;
+    case OPT_MAX_MEMORY: Reservation::set_limit(size_option(optarg)); break;
+    case OPT_CONNECTIONS: c.connections = count_option(optarg); break;
+    case OPT_CONTROL_PERSIST: c.transport.control_persist = optarg; break;
+    case OPT_RETRIES: c.transport.retries = count_option(optarg, 0); break;
+    case OPT_SFTP_COMMAND: c.transport.sftp_command = optarg; break;
+    case OPT_AGENT: agent = true; break;
+    case OPT_NO_AGENT: c.transport.agent = false; break;
+    case OPT_EVENT_LOOP:
+      if(!EventLoop::supported()) {
+        fprintf(stderr, "ERROR: --event-loop not supported on this platform\n");
+        return 2;
+      }
+      c.event_loop = true;
+      break;
     default: {
       auto it = passthru_option_map.find(n);
       if(it != passthru_option_map.end()) {
+        c.flags |= passthru_option_flags[n];
         if(optarg)
           c.extra_args.push_back(it->second + "=" + optarg);
         else
@@ -220,6 +329,39 @@ int main(int argc, char **argv) {
     }
     }
   }
+  if(c.min_window > c.max_window) {
+    fprintf(stderr, "ERROR: --min-window must not exceed --max-window\n");
+    return 2;
+  }
+
+  // Checksum standard input for --delta on another host
+  if(block_sums) {
+    if(argc - optind != 0) {
+      fprintf(stderr, "ERROR: --block-sums takes no file arguments\n");
+      return 2;
+    }
+    return write_block_sums(0, block_sums, stdout);
+  }
+
+  if(agent) {
+    if(argc - optind != 0) {
+      fprintf(stderr, "ERROR: --agent takes no file arguments\n");
+      return 2;
+    }
+    // Suppress SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    try {
+      Agent a(c.transport);
+      a.listen();
+      // Stay in the foreground for debugging
+      if(!debug)
+        a.detach();
+      a.run();
+    } catch(std::runtime_error &e) {
+      fprintf(stderr, "ERROR: %s\n", e.what());
+      return 2;
+    }
+  }
 
   // Check we have what we expected
   if(argc - optind != 2) {
@@ -34,6 +34,21 @@ enum {
   OPT_HELP,
   OPT_VERSION,
   OPT_DEBUG,
+  OPT_MIN_WINDOW,
+  OPT_MAX_WINDOW,
+  OPT_CONNECTIONS,
+  OPT_CONTROL_PERSIST,
+  OPT_AGENT,
+  OPT_NO_AGENT,
+  OPT_EVENT_LOOP,
+  OPT_BUFFER_LIMIT,
+  OPT_SPOOL_LIMIT,
+  OPT_MAX_MEMORY,
+  OPT_RETRIES,
+  OPT_SFTP_COMMAND,
+  OPT_REMOTE_HASH,
+  OPT_DELTA,
+  OPT_BLOCK_SUMS,
 };
 
 /** @brief Treat first file as empty if missing */
@@ -45,4 +60,7 @@ enum {
 /** @brief Report identical files */
 #define REPORT_IDENTICAL 4
 
+/** @brief Options may make files with different contents compare equal */
+#define NORMALIZE 8
+
 #endif
@@ -0,0 +1,79 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ring.h"
+
+void Ring::push(Buffer b) {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    if(gone)
+      return;
+    bytes += b.size();
+    buffers.push_back(std::move(b));
+  }
+  changed.notify_all();
+}
+
+bool Ring::pop(Buffer &b) {
+  {
+    std::unique_lock<std::mutex> locked(lock);
+    while(buffers.empty() && !closed && !gone)
+      changed.wait(locked);
+    if(buffers.empty() || gone)
+      return false;
+    b = std::move(buffers.front());
+    buffers.pop_front();
+    bytes -= b.size();
+  }
+  changed.notify_all();
+  return true;
+}
+
+size_t Ring::size() {
+  std::lock_guard<std::mutex> g(lock);
+  return bytes;
+}
+
+bool Ring::wait_below(size_t limit) {
+  std::unique_lock<std::mutex> locked(lock);
+  while(bytes >= limit && !gone)
+    changed.wait(locked);
+  return !gone;
+}
+
+void Ring::close() {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    closed = true;
+  }
+  changed.notify_all();
+}
+
+void Ring::abandon() {
+  {
+    std::lock_guard<std::mutex> g(lock);
+    gone = true;
+    buffers.clear();
+    bytes = 0;
+  }
+  changed.notify_all();
+}
+
+bool Ring::abandoned() {
+  std::lock_guard<std::mutex> g(lock);
+  return gone;
+}
@@ -0,0 +1,100 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RING_H
+#define RING_H
+/** @file ring.h
+ * @brief Bounded queue of buffers between threads
+ */
+
+#include <config.h>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include "buffer.h"
+
+/** @brief A queue of buffers passed from a producer to a consumer thread
+ *
+ * The producer adds buffers with @ref push and ends the stream with @ref
+ * close. The consumer removes them with @ref pop, and calls @ref abandon
+ * if it stops early.
+ *
+ * The ring does not limit its own size; the producer is expected to
+ * consult @ref size and, if necessary, @ref wait_below before adding more.
+ */
+class Ring {
+public:
+  /** @brief Add a buffer to the ring
+   * @param b Buffer to add
+   *
+   * If the ring has been abandoned, @p b is discarded.
+   */
+  void push(Buffer b);
+
+  /** @brief Remove the oldest buffer from the ring
+   * @param b Where to store the buffer
+   * @return @c true on success, @c false if there are no more buffers
+   *
+   * Waits until a buffer is available or the ring is closed.
+   */
+  bool pop(Buffer &b);
+
+  /** @brief Return the number of bytes in the ring */
+  size_t size();
+
+  /** @brief Wait for the ring to drain
+   * @param limit Size to wait for
+   * @return @c true on success, @c false if the ring has been abandoned
+   *
+   * Waits until the ring holds fewer than @p limit bytes.
+   */
+  bool wait_below(size_t limit);
+
+  /** @brief Indicate that no more buffers will be added */
+  void close();
+
+  /** @brief Indicate that no more buffers will be removed
+   *
+   * Any buffers in the ring are discarded.
+   */
+  void abandon();
+
+  /** @brief Return @c true if the ring has been abandoned */
+  bool abandoned();
+
+private:
+  /** @brief Lock protecting later fields */
+  std::mutex lock;
+
+  /** @brief Signalled when the ring changes */
+  std::condition_variable changed;
+
+  /** @brief Buffers in the ring, oldest first */
+  std::deque<Buffer> buffers;
+
+  /** @brief Total size of @ref buffers */
+  size_t bytes = 0;
+
+  /** @brief Set by @ref close */
+  bool closed = false;
+
+  /** @brief Set by @ref abandon */
+  bool gone = false;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "scheduler.h"
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+unsigned Scheduler::add(const std::string &name) {
+  std::lock_guard<std::mutex> g(lock);
+  unsigned id = next_id++;
+  streams[id].name = name;
+  return id;
+}
+
+void Scheduler::remove(unsigned id) {
+  std::lock_guard<std::mutex> g(lock);
+  streams.erase(id);
+  allot();
+}
+
+size_t Scheduler::credit(unsigned id, size_t demand) {
+  std::lock_guard<std::mutex> g(lock);
+  auto it = streams.find(id);
+  if(it == streams.end())
+    return 0;
+  Stream &s = it->second;
+  if(demand != s.demand) {
+    s.demand = demand;
+    allot();
+  }
+  if(s.inflight == 0)
+    return std::max(s.share, (size_t)1);
+  return s.share > s.inflight ? s.share - s.inflight : 0;
+}
+
+void Scheduler::issued(unsigned id, size_t bytes) {
+  std::lock_guard<std::mutex> g(lock);
+  auto it = streams.find(id);
+  if(it != streams.end())
+    it->second.inflight += bytes;
+}
+
+void Scheduler::completed(unsigned id, size_t bytes) {
+  std::lock_guard<std::mutex> g(lock);
+  auto it = streams.find(id);
+  if(it != streams.end())
+    it->second.inflight -= std::min(bytes, it->second.inflight);
+}
+
+std::string Scheduler::status() {
+  std::lock_guard<std::mutex> g(lock);
+  std::string s;
+  for(auto &it : streams) {
+    char buffer[128];
+    snprintf(buffer, sizeof buffer, "%s%zu/%zu bytes for ",
+             s.size() ? "; " : "", it.second.inflight, it.second.share);
+    s += buffer;
+    s += it.second.name;
+  }
+  return s;
+}
+
+void Scheduler::allot() {
+  // Order streams by increasing demand
+  std::vector<Stream *> order;
+  size_t capacity = 0;
+  for(auto &it : streams) {
+    order.push_back(&it.second);
+    capacity = std::max(capacity, it.second.demand);
+  }
+  std::sort(order.begin(), order.end(), [](Stream *a, Stream *b) {
+    return a->demand < b->demand;
+  });
+  // Satisfy the smallest demands first and split the rest evenly
+  size_t remaining = capacity;
+  for(size_t n = 0; n < order.size(); ++n) {
+    size_t level = remaining / (order.size() - n);
+    order[n]->share = std::min(order[n]->demand, level);
+    remaining -= order[n]->share;
+  }
+}
@@ -0,0 +1,116 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+/** @file scheduler.h
+ * @brief Fair sharing of a connection between streams of reads
+ */
+
+#include <config.h>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+/** @brief Fair-share scheduler for reads on one connection
+ *
+ * Replies on a connection arrive in the order the requests were sent, so
+ * each stream of reads gets bandwidth in proportion to the bytes it has
+ * in flight. If two files on the same host are read over one connection,
+ * one can therefore starve the other, although diff needs both.
+ *
+ * Each stream states its demand, i.e. the bytes it would like in flight.
+ * The capacity of the connection is taken to be the largest demand, and
+ * is divided between the streams max-min fairly: no stream is allotted
+ * more than it asked for, and the rest is split evenly. Since demands
+ * follow each consumer's delivered rate, a stream that drains faster gets
+ * a larger share.
+ *
+ * A stream with nothing in flight is always allowed one read, so no
+ * stream can be starved entirely.
+ */
+class Scheduler {
+public:
+  /** @brief Add a stream
+   * @param name Name for debug output
+   * @return Stream ID
+   */
+  unsigned add(const std::string &name);
+
+  /** @brief Remove a stream
+   * @param id Stream ID
+   */
+  void remove(unsigned id);
+
+  /** @brief Find out how much a stream may issue
+   * @param id Stream ID
+   * @param demand Bytes the stream would like in flight
+   * @return Further bytes the stream may put in flight
+   */
+  size_t credit(unsigned id, size_t demand);
+
+  /** @brief Record a read being issued
+   * @param id Stream ID
+   * @param bytes Bytes requested
+   */
+  void issued(unsigned id, size_t bytes);
+
+  /** @brief Record a read completing
+   * @param id Stream ID
+   * @param bytes Bytes that were requested
+   */
+  void completed(unsigned id, size_t bytes);
+
+  /** @brief Describe the state of each stream, for debugging
+   * @return Description listing each stream's bytes in flight and share
+   */
+  std::string status();
+
+private:
+  /** @brief State of a stream */
+  struct Stream {
+    /** @brief Name for debug output */
+    std::string name;
+
+    /** @brief Bytes wanted in flight */
+    size_t demand = 0;
+
+    /** @brief Bytes in flight */
+    size_t inflight = 0;
+
+    /** @brief Bytes allotted */
+    size_t share = 0;
+  };
+
+  /** @brief Lock protecting later fields */
+  std::mutex lock;
+
+  /** @brief Streams, by ID */
+  std::map<unsigned, Stream> streams;
+
+  /** @brief Next stream ID */
+  unsigned next_id = 0;
+
+  /** @brief Recompute shares after a change in demand
+   *
+   * Must be called with @c lock held.
+   */
+  void allot();
+};
+
+#endif
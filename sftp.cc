@@ -18,13 +18,23 @@
 #include "sftp.h"
 #include "misc.h"
 #include "sftp-internal.h"
+#include "eventloop.h"
+#include "sha256.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <csignal>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <cstring>
 #include <cinttypes>
+#include <climits>
+#include <algorithm>
 
-SFTP::Connection::Connection(const std::string &name_) : name(name_) {}
+SFTP::Connection::Connection(const std::string &name_,
+                             const Transport &transport_) :
+  name(name_), transport(transport_) {}
 
 SFTP::Connection::~Connection() {
   disconnect();
@@ -35,8 +45,91 @@ void SFTP::Connection::connect() {
     return;
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, name.c_str());
+  try {
+    poll_quit = false;
+    failure.clear();
+    reconnects = 0;
+    {
+      std::lock_guard<std::mutex> g(output_lock);
+      extensions = handshake();
+    }
+    // Start receiving replies
+    if(transport.loop)
+      attach();
+    else
+      poller = std::thread(SFTP::Connection::poll, this);
+    // Find out how big our reads can be
+    home.clear();
+    limits_pending = false;
+    read_length = DEFAULT_READ_LENGTH;
+    open_handles = 0;
+    if(extension("limits@openssh.com"))
+      limits();
+  } catch(std::exception &e) {
+    disconnect();
+    throw;
+  }
+}
+
+std::map<std::string, std::string> SFTP::Connection::handshake() {
+  input_ptr = input_total = 0;
+  // Use the agent if there is one, otherwise start a new session
+  bool via_agent =
+    transport.agent && transport.sftp_command.empty() && connect_agent();
+  if(!via_agent)
+    spawn();
+  // Send SSH_FXP_INIT
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_INIT);
+  pack32(cmd, 3);
+  if(via_agent) {
+    // Tell the agent which host we want
+    packstr(cmd, AGENT_HOST_EXTENSION);
+    packstr(cmd, name);
+  }
+  send_now(cmd);
+  // Get the response
+  std::string body;
+  int reply_type = recv_reply(body);
+  if(reply_type == SSH_FXP_STATUS && via_agent) {
+    // The agent could not reach the host
+    size_t pos = 0;
+    unpack32(body, pos);                     // uint32 id
+    uint32_t status = unpack32(body, pos);   // uint32 error/status code
+    std::string msg = unpackstr(body, pos); // string error message
+    throw Error(status, msg);
+  }
+  if(reply_type != SSH_FXP_VERSION)
+    syserror(name + ": unsupported reply");
+  size_t pos = 0;
+  uint32_t version = unpack32(body, pos);
+  if(version < 3)
+    syserror(name + ": unsupported SFTP version");
+  // The rest of the reply is extension name/data pairs
+  std::map<std::string, std::string> advertised;
+  while(pos < body.size()) {
+    std::string ext = unpackstr(body, pos);  // string extension-name
+    std::string data = unpackstr(body, pos); // string extension-data
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s extension %s=%s\n", __func__,
+              name.c_str(), ext.c_str(), data.c_str());
+    advertised[ext] = data;
+  }
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s SSH_FXP_INIT succeeded%s\n", __func__,
+            name.c_str(), via_agent ? " via agent" : "");
+  return advertised;
+}
+
+void SFTP::Connection::spawn() {
   int wpipe[2] = { -1, -1 }, rpipe[2] = { -1, -1 };
   try {
+    // Construct the command before forking
+    std::vector<std::string> args = command();
+    std::vector<const char *> cargs;
+    for(auto &a : args)
+      cargs.push_back(a.c_str());
+    cargs.push_back(nullptr);
     // Create pipes to subprocess
     if(pipe(wpipe) < 0)
       syserror("pipe", errno);
@@ -57,8 +150,8 @@ void SFTP::Connection::connect() {
         _Exit(2);
       }
       // Remotely execute the SFTP subsystem
-      execlp("ssh", "ssh", "-s", name.c_str(), "sftp", (char *)nullptr);
-      fprintf(stderr, "ERROR: execlp ssh %s: %s\n", name.c_str(),
+      execvp(cargs[0], (char **)&cargs[0]);
+      fprintf(stderr, "ERROR: execvp %s %s: %s\n", cargs[0], name.c_str(),
               strerror(errno));
       _Exit(2);
     }
@@ -74,27 +167,6 @@ void SFTP::Connection::connect() {
     // Don't leak pipe endpoints to other processes
     close_on_exec(rfd);
     close_on_exec(wfd);
-    // Send SSH_FXP_INIT
-    std::string cmd;
-    newpacket(cmd, SSH_FXP_INIT);
-    pack32(cmd, 3);
-    send(cmd);
-    // Get the response
-    std::string body;
-    int reply_type = recv_reply(body);
-    if(reply_type != SSH_FXP_VERSION)
-      syserror(name + ": unsupported reply");
-    size_t pos = 0;
-    uint32_t version = unpack32(body, pos);
-    if(version < 3)
-      syserror(name + ": unsupported SFTP version");
-    if(debug)
-      fprintf(stderr, "DEBUG: %s %s SSH_FXP_INIT succeeded\n", __func__,
-              name.c_str());
-    // Start the polling thread
-    poller = std::thread(SFTP::Connection::poll, this);
-    // Get the home directory
-    home = realpath("");
   } catch(std::exception &e) {
     if(rpipe[0] >= 0)
       ::close(rpipe[0]);
@@ -104,31 +176,157 @@ void SFTP::Connection::connect() {
       ::close(wpipe[0]);
     if(wpipe[1] >= 0)
       ::close(wpipe[1]);
-    disconnect();
     throw;
   }
 }
 
+bool SFTP::Connection::connect_agent() {
+  // Only the agent creates the directory; if it is missing or unsafe there is
+  // no agent to use
+  std::string path = Transport::agent_socket(false);
+  struct sockaddr_un addr;
+  if(path.empty() || path.size() >= sizeof addr.sun_path)
+    return false;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(PF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+    syserror("socket");
+  if(::connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    // No agent, or a stale socket
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s: %s\n", __func__, path.c_str(),
+              strerror(errno));
+    ::close(fd);
+    return false;
+  }
+  close_on_exec(fd);
+  rfd = fd;
+  if((wfd = dup(fd)) < 0)
+    syserror("dup");
+  close_on_exec(wfd);
+  return true;
+}
+
+std::vector<std::string> SFTP::Connection::command() const {
+  std::vector<std::string> args;
+  if(transport.sftp_command.size()) {
+    std::string cmd;
+    for(size_t n = 0; n < transport.sftp_command.size(); ++n) {
+      char ch = transport.sftp_command[n];
+      if(ch == '%' && n + 1 < transport.sftp_command.size()) {
+        switch(transport.sftp_command[++n]) {
+        case 'h': cmd += shell_quote(name); continue;
+        case '%': cmd += '%'; continue;
+        default: --n; break;
+        }
+      }
+      cmd += ch;
+    }
+    args.push_back("/bin/sh");
+    args.push_back("-c");
+    args.push_back(cmd);
+    return args;
+  }
+  args = ssh_command();
+  args.push_back("-s");
+  args.push_back(name);
+  args.push_back("sftp");
+  return args;
+}
+
+std::vector<std::string> SFTP::Connection::ssh_command() const {
+  std::vector<std::string> args;
+  args.push_back("ssh");
+  if(transport.control_persist.size()) {
+    args.push_back("-oControlMaster=auto");
+    args.push_back("-oControlPath=" + Transport::runtime_directory() + "/%C");
+    args.push_back("-oControlPersist=" + transport.control_persist);
+  }
+  return args;
+}
+
+std::string SFTP::Transport::runtime_directory(bool create) {
+  std::string dir;
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if(runtime && *runtime)
+    dir = std::string(runtime) + "/remdiff";
+  else
+    dir = "/tmp/remdiff-" + std::to_string(getuid());
+  if(create && mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    syserror(dir);
+  // Refuse to use a directory that someone else could interfere with
+  struct stat sb;
+  if(lstat(dir.c_str(), &sb) < 0) {
+    if(!create)
+      return "";
+    syserror(dir);
+  }
+  if(!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & 077)) {
+    if(!create)
+      return "";
+    syserror(dir + ": unsafe runtime directory", EPERM);
+  }
+  return dir;
+}
+
+std::string SFTP::Transport::agent_socket(bool create) {
+  std::string dir = runtime_directory(create);
+  return dir.size() ? dir + "/agent" : dir;
+}
+
 void SFTP::Connection::disconnect() {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, name.c_str());
+  // The server going away from now on is not a reason to reconnect
+  {
+    std::lock_guard<std::mutex> g(lock);
+    poll_quit = true;
+  }
+  // Wait for a reconnect to give up, and for the loop thread to act on it
+  if(reconnector.joinable()) {
+    reconnector.join();
+    if(!transport.loop->in_loop()) {
+      std::promise<void> done;
+      transport.loop->post([&done]() { done.set_value(); });
+      done.get_future().wait();
+    }
+  }
+  // Detach from the event loop
+  if(transport.loop) {
+    // A reconnect may replace rfd while we wait for its handler
+    int fd;
+    do {
+      fd = rfd;
+      if(fd >= 0)
+        transport.loop->unwatch(fd);
+    } while(fd != rfd);
+    if(wfd >= 0)
+      transport.loop->unwatch(wfd);
+  }
+  // Close our write endpoint first. If the poll thread is still waiting for
+  // replies, the server will see EOF and go away, and it will see EOF in
+  // turn.
+  {
+    std::lock_guard<std::mutex> g(output_lock);
+    if(wfd >= 0) {
+      ::shutdown(wfd, SHUT_WR); // in case it's a socket
+      ::close(wfd);
+      wfd = -1;
+    }
+  }
   // Terminate the poller thread
   if(poller.joinable()) {
-    {
-      std::unique_lock<std::mutex> locked(lock);
-      poll_quit = true;
-    }
     cond.notify_all();
     if(debug)
       fprintf(stderr, "DEBUG: %s %s joining poller\n", __func__, name.c_str());
     poller.join();
   }
-  // Close our pipe endpoints
+  // Close our read endpoint
   if(rfd >= 0)
     ::close(rfd);
-  if(wfd >= 0)
-    ::close(wfd);
-  rfd = wfd = -1;
+  rfd = -1;
   // Wait for the subprocess to terminate
   if(pid >= 0) {
     if(debug)
@@ -163,15 +361,158 @@ void SFTP::Connection::packstr(std::string &s, const std::string &str) {
 void SFTP::Connection::send(std::string &s) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, name.c_str());
+  std::unique_lock<std::mutex> locked(output_lock);
+  if(!send_locked(s)) {
+    locked.unlock();
+    size_t pos = 5;
+    unsendable(unpack32(s, pos), s[4]);
+  }
+}
+
+bool SFTP::Connection::send_locked(std::string &s) {
   // Substitute in the message length
   uint32_t len = tobe32(s.size() - 4);
   s.replace(0, sizeof len, (char *)&len, sizeof len);
-  // Send the packet
-  std::lock_guard<std::mutex> g(lock);
+  if(transport.retries)
+    keep(s);
+  // The request will be sent when the reconnect completes
+  if(reconnecting)
+    return true;
+  if(!prepare(s))
+    return false;
+  // Send the packet, along with anything already queued
+  next_pending().swap(s);
+  flush_locked();
+  return true;
+}
+
+void SFTP::Connection::send_now(std::string &s) {
+  uint32_t len = tobe32(s.size() - 4);
+  s.replace(0, sizeof len, (char *)&len, sizeof len);
   if(writeall(wfd, &s[0], s.size()) < 0)
     syserror(name + ": write", errno);
-  // Wake the poll thread.
-  cond.notify_all();
+}
+
+void SFTP::Connection::keep(const std::string &packet) {
+  size_t pos = 5;
+  std::lock_guard<std::mutex> g(lock);
+  Slot *slot = find_slot(unpack32(packet, pos));
+  if(slot) {
+    slot->request_type = packet[4];
+    slot->request.assign(packet);
+  }
+}
+
+bool SFTP::Connection::prepare(std::string &packet) {
+  if(has_handle(packet[4]) && aliased) {
+    size_t pos = 9;
+    auto it = files.find(unpackstr(packet, pos));
+    if(it != files.end() && it->second.server != it->first) {
+      // The file could not be reopened after a reconnect
+      if(it->second.server.empty())
+        return false;
+      rehandle(packet, it->second.server);
+    }
+  }
+  return true;
+}
+
+void SFTP::Connection::unsendable(uint32_t id, uint8_t type) {
+  // There is nothing left to close
+  synthesize(id, type == SSH_FXP_CLOSE ? SSH_FX_OK : SSH_FX_CONNECTION_LOST,
+             "connection lost");
+}
+
+bool SFTP::Connection::has_handle(uint8_t type) {
+  switch(type) {
+  case SSH_FXP_CLOSE:
+  case SSH_FXP_READ:
+  case SSH_FXP_WRITE:
+  case SSH_FXP_FSTAT:
+  case SSH_FXP_FSETSTAT:
+  case SSH_FXP_READDIR: return true;
+  default: return false;
+  }
+}
+
+void SFTP::Connection::rehandle(std::string &packet,
+                                const std::string &handle) {
+  size_t pos = 9;
+  unpackstr(packet, pos);
+  std::string rest(packet, pos);
+  packet.resize(9);
+  packstr(packet, handle);
+  packet.append(rest);
+  uint32_t len = tobe32(packet.size() - 4);
+  packet.replace(0, sizeof len, (char *)&len, sizeof len);
+}
+
+std::string &SFTP::Connection::next_pending() {
+  if(npending == pending.size())
+    pending.emplace_back();
+  return pending[npending++];
+}
+
+void SFTP::Connection::flush() {
+  std::lock_guard<std::mutex> g(output_lock);
+  flush_locked();
+}
+
+void SFTP::Connection::flush_locked() {
+  if(reconnecting)
+    return;
+  if(debug && npending)
+    fprintf(stderr, "DEBUG: %s %s %zu packets\n", __func__, name.c_str(),
+            npending);
+  iov.resize(npending);
+  for(size_t n = 0; n < npending; ++n) {
+    iov[n].iov_base = &pending[n][0];
+    iov[n].iov_len = pending[n].size();
+  }
+  size_t start = 0;
+  while(start < npending) {
+    size_t count = npending - start;
+    if(count > IOV_MAX)
+      count = IOV_MAX;
+    ssize_t written = ::writev(wfd, &iov[start], count);
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN && transport.loop) {
+        // Keep whatever is unwritten and wait until the server can take
+        // more.
+        pending[start].erase(0, (char *)iov[start].iov_base -
+                                  &pending[start][0]);
+        std::rotate(pending.begin(), pending.begin() + start,
+                    pending.begin() + npending);
+        npending -= start;
+        if(!write_blocked) {
+          write_blocked = true;
+          transport.loop->watch(wfd, EventLoop::WRITE,
+                                [this](unsigned) { writable(); });
+        }
+        return;
+      }
+      npending = 0;
+      // If the server has gone away then reading will discover it too,
+      // and everything outstanding will be sent again after reconnecting.
+      if(transport.retries)
+        return;
+      syserror(name + ": write", errno);
+    }
+    // Skip over whatever was written
+    while(written > 0) {
+      if((size_t)written >= iov[start].iov_len) {
+        written -= iov[start].iov_len;
+        ++start;
+      } else {
+        iov[start].iov_base = (char *)iov[start].iov_base + written;
+        iov[start].iov_len -= written;
+        written = 0;
+      }
+    }
+  }
+  npending = 0;
 }
 
 void SFTP::Connection::recv(char *buffer, size_t n) {
@@ -189,7 +530,21 @@ void SFTP::Connection::recv(char *buffer, size_t n) {
       n -= available;
       continue;
     }
-    // Buffer empty, need to read more
+    // Buffer empty, need to read more. If the caller wants at least a
+    // bufferful, read directly into their buffer.
+    if(n >= sizeof input) {
+      ssize_t bytes_read = ::read(rfd, buffer, n);
+      if(bytes_read == 0)
+        syserror(name + ": unexpected EOF");
+      if(bytes_read < 0) {
+        if(errno != EINTR)
+          syserror(name + ": read", errno);
+        continue;
+      }
+      buffer += bytes_read;
+      n -= bytes_read;
+      continue;
+    }
     ssize_t bytes_read = ::read(rfd, input, sizeof input);
     if(bytes_read == 0)
       syserror(name + ": unexpected EOF");
@@ -203,7 +558,7 @@ void SFTP::Connection::recv(char *buffer, size_t n) {
   }
 }
 
-int SFTP::Connection::recv_reply(std::string &body) {
+int SFTP::Connection::recv_reply(std::string &body, Buffer *data) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, name.c_str());
   // Get the length
@@ -217,6 +572,22 @@ int SFTP::Connection::recv_reply(std::string &body) {
   uint8_t type;
   recv((char *)&type, 1);
   --len;
+  if(data && type == SSH_FXP_DATA) {
+    // Get the ID and the data length
+    if(len < 8)
+      syserror(name + ": truncated reply");
+    body.resize(8);
+    recv(&body[0], 8);
+    size_t pos = 4;
+    uint32_t data_len = unpack32(body, pos);
+    if(data_len != len - 8)
+      syserror(name + ": malformed SSH_FXP_DATA");
+    body.resize(4);
+    // Get the payload
+    *data = Buffer::get(data_len);
+    recv(data->data(), data_len);
+    return type;
+  }
   // Get the body
   body.resize(len);
   recv(&body[0], len);
@@ -253,77 +624,631 @@ std::string SFTP::Connection::unpackstr(const std::string &s,
   return r;
 }
 
-uint32_t SFTP::Connection::newid() {
+uint32_t SFTP::Connection::newid(Completion completion) {
+  return newslot(std::move(completion))->id;
+}
+
+SFTP::Connection::Slot *SFTP::Connection::newslot(Completion completion) {
+  std::unique_lock<std::mutex> locked(lock);
+  if(failure.size())
+    throw std::runtime_error(failure);
+  while(free_slots.size() == 0) {
+    // Grow the table if possible
+    size_t size = slots.size(), new_size = size ? 2 * size : INITIAL_SLOTS;
+    if(new_size > ((size_t)1 << SLOT_BITS))
+      new_size = (size_t)1 << SLOT_BITS;
+    if(new_size > size) {
+      slots.reserve(new_size);
+      free_slots.reserve(new_size);
+      for(size_t n = size; n < new_size; ++n)
+        slots.push_back(std::unique_ptr<Slot>(new Slot()));
+      // Push in reverse order so that low indexes are used first
+      for(size_t n = new_size; n > size; --n)
+        free_slots.push_back(n - 1);
+      break;
+    }
+    // Every possible ID is in use; wait for one to be freed
+    slot_freed.wait(locked);
+    if(failure.size())
+      throw std::runtime_error(failure);
+  }
+  uint32_t index = free_slots.back();
+  free_slots.pop_back();
+  Slot *slot = slots[index].get();
+  // Bump the generation number
+  slot->id = (((slot->id >> SLOT_BITS) + 1) << SLOT_BITS) | index;
+  slot->state = Slot::WAITING;
+  slot->completion = std::move(completion);
+  slot->request_type = 0;
+  // Wake the poll thread if it was idle
+  if(outstanding++ == 0)
+    cond.notify_one();
+  return slot;
+}
+
+SFTP::Connection::Slot *SFTP::Connection::find_slot(uint32_t id) {
+  uint32_t index = id & (((uint32_t)1 << SLOT_BITS) - 1);
+  if(index >= slots.size())
+    return nullptr;
+  Slot *slot = slots[index].get();
+  if(slot->id != id || slot->state == Slot::FREE)
+    return nullptr;
+  return slot;
+}
+
+void SFTP::Connection::free_slot(Slot *slot) {
+  slot->state = Slot::FREE;
+  slot->data.release();
+  slot->completion = nullptr;
+  free_slots.push_back(slot->id & (((uint32_t)1 << SLOT_BITS) - 1));
+  // Several slots may be freed before any waiter runs, so wake one waiter
+  // per slot rather than only on the empty-to-nonempty transition
+  slot_freed.notify_one();
+}
+
+bool SFTP::Connection::abandon(uint32_t id) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %#" PRIx32 "\n", __func__, name.c_str(), id);
+  // Declared first so that it is destroyed after the lock is released
+  Completion completion;
   std::lock_guard<std::mutex> g(lock);
-  // Skip IDs that are in use
-  while(replies.find(nextid) != replies.end()
-        || waiting.find(nextid) != waiting.end())
-    nextid++;
-  uint32_t id = nextid++;
-  // Record the ID.
-  waiting.insert(id);
-  return id;
+  Slot *slot = find_slot(id);
+  if(!slot)
+    return false;
+  if(slot->state == Slot::DONE) {
+    // The reply has been stashed already
+    free_slot(slot);
+    return true;
+  }
+  // Discard the reply when it arrives
+  completion.swap(slot->completion);
+  slot->completion = [](Reply &, std::exception_ptr) {};
+  return true;
 }
 
-int SFTP::Connection::await_reply(uint32_t id, std::string &body) {
+int SFTP::Connection::await_reply(uint32_t id, std::string &body,
+                                  Buffer *data) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, name.c_str());
   std::unique_lock<std::mutex> locked(lock);
-  for(;;) {
-    // If we have a suitable reply, use it
-    auto it = replies.find(id);
-    if(it != replies.end()) {
-      body = it->second.body;
-      int type = it->second.type;
-      replies.erase(it);
-      return type;
+  Slot *slot = find_slot(id);
+  if(!slot)
+    throw std::logic_error("await_reply: unknown ID");
+  // Wait for the reply to appear
+  while(slot->state != Slot::DONE) {
+    if(failure.size()) {
+      --outstanding;
+      free_slot(slot);
+      throw std::runtime_error(failure);
     }
-    // Wait for a reply to appear
-    cond.wait(locked);
+    slot->cond.wait(locked);
   }
+  body.swap(slot->body);
+  if(data)
+    *data = std::move(slot->data);
+  int type = slot->type;
+  free_slot(slot);
+  return type;
 }
 
 void SFTP::Connection::poll(SFTP::Connection *self) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s\n", __func__, self->name.c_str());
   std::string buffer;
+  Buffer data;
   for(;;) {
-    // Pause until there is at least one waiter
-    {
-      std::unique_lock<std::mutex> locked(self->lock);
-      while(!self->waiting.size() && !self->poll_quit) {
-        if(debug)
-          fprintf(stderr, "DEBUG: %s %s waiting for action\n", __func__,
-                  self->name.c_str());
-        self->cond.wait(locked);
+    try {
+      // Pause until there is at least one waiter
+      {
+        std::unique_lock<std::mutex> locked(self->lock);
+        while(!self->outstanding && !self->poll_quit) {
+          if(debug)
+            fprintf(stderr, "DEBUG: %s %s waiting for action\n", __func__,
+                    self->name.c_str());
+          self->cond.wait(locked);
+        }
+        if(self->poll_quit) {
+          if(debug)
+            fprintf(stderr, "DEBUG: %s %s quit\n", __func__,
+                    self->name.c_str());
+          return;
+        }
       }
-      if(self->poll_quit) {
-        if(debug)
-          fprintf(stderr, "DEBUG: %s %s quit\n", __func__, self->name.c_str());
+
+      // Get a reply
+      if(debug)
+        fprintf(stderr, "DEBUG: %s %s reading\n", __func__, self->name.c_str());
+      int type = self->recv_reply(buffer, &data);
+      self->deliver(type, buffer, data);
+    } catch(std::exception &e) {
+      if(!self->lost(e.what()))
         return;
-      }
     }
+  }
+}
+
+void SFTP::Connection::deliver(int type, std::string &body, Buffer &data,
+                               bool synthetic) {
+  size_t pos = 0;
+  uint32_t id = unpack32(body, pos);
+  Completion completion;
+  {
+    std::lock_guard<std::mutex> g(lock);
+    Slot *slot = find_slot(id);
+    if(!slot || slot->state != Slot::WAITING) {
+      if(debug)
+        fprintf(stderr, "DEBUG: %s %s ignoring reply to %#" PRIx32 "\n",
+                __func__, name.c_str(), id);
+      data.release();
+      return;
+    }
+    --outstanding;
+    // The server is answering again, so a later loss is a new outage
+    if(!synthetic)
+      reconnects = 0;
+    if(slot->completion) {
+      // The reply is delivered directly, below
+      completion.swap(slot->completion);
+      free_slot(slot);
+    } else {
+      if(debug)
+        fprintf(stderr, "DEBUG: %s %s stashing\n", __func__, name.c_str());
+      // Stash the reply for collection
+      slot->type = type;
+      slot->body.swap(body);
+      slot->data = std::move(data);
+      slot->state = Slot::DONE;
+      // Wake the waiter
+      slot->cond.notify_one();
+    }
+  }
+  if(completion) {
+    Reply reply;
+    reply.type = type;
+    reply.body.swap(body);
+    reply.data = std::move(data);
+    completion(reply, nullptr);
+  }
+}
 
-    // Get a reply
+void SFTP::Connection::fail(const std::string &why) {
+  std::vector<Completion> completions;
+  {
+    std::lock_guard<std::mutex> g(lock);
     if(debug)
-      fprintf(stderr, "DEBUG: %s %s reading\n", __func__, self->name.c_str());
-    int type = self->recv_reply(buffer);
+      fprintf(stderr, "DEBUG: %s %s: %s\n", __func__, name.c_str(),
+              why.c_str());
+    // Fail anything still waiting
+    failure = why;
+    for(auto &slot : slots) {
+      if(slot->state == Slot::WAITING && slot->completion) {
+        completions.push_back(std::move(slot->completion));
+        --outstanding;
+        free_slot(slot.get());
+      }
+      slot->cond.notify_all();
+    }
+    slot_freed.notify_all();
+  }
+  Reply reply;
+  std::exception_ptr error = std::make_exception_ptr(std::runtime_error(why));
+  for(auto &completion : completions)
+    completion(reply, error);
+}
+
+bool SFTP::Connection::lost(std::string why) {
+  bool hopeless;
+  {
+    std::lock_guard<std::mutex> g(lock);
+    hopeless = poll_quit || reconnects >= transport.retries;
+  }
+  if(hopeless) {
+    fail(why);
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> g(output_lock);
+    if(reconnecting)
+      return true;
+    // Abandon the old session. Until the reconnect is finished, rfd, wfd,
+    // pid and the output queue belong to it.
+    if(transport.loop) {
+      transport.loop->unwatch(rfd);
+      transport.loop->unwatch(wfd);
+    }
+    ::close(rfd);
+    ::close(wfd);
+    rfd = wfd = -1;
+    npending = 0;
+    write_blocked = false;
+    reconnecting = true;
+  }
+  if(transport.loop) {
+    // Handlers must not block, so reconnect in another thread and pick up
+    // the result in the loop thread
+    if(reconnector.joinable())
+      reconnector.join();
+    reconnector = std::thread([this, why]() mutable {
+      bool ok = retry(why);
+      transport.loop->post([this, ok, why]() { finish(ok, why); });
+    });
+    return true;
+  }
+  bool ok = retry(why);
+  finish(ok, why);
+  return ok;
+}
+
+bool SFTP::Connection::retry(std::string &why) {
+  for(unsigned attempt = 0;; ++attempt) {
+    {
+      std::lock_guard<std::mutex> g(lock);
+      if(poll_quit || reconnects >= transport.retries)
+        return false;
+      ++reconnects;
+    }
+    // Back off if the server is still unreachable
+    if(attempt > 0)
+      sleep(1u << std::min(attempt - 1, 4u));
+    fprintf(stderr, "WARNING: %s; reconnecting\n", why.c_str());
+    try {
+      reconnect();
+      return true;
+    } catch(std::exception &e) {
+      why = e.what();
+    }
+  }
+}
+
+void SFTP::Connection::reconnect() {
+  // Clean up after the previous session or attempt
+  if(rfd >= 0)
+    ::close(rfd);
+  if(wfd >= 0)
+    ::close(wfd);
+  rfd = wfd = -1;
+  if(pid >= 0) {
+    kill(pid, SIGTERM);
+    while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+    pid = -1;
+  }
+  npending = 0;
+  handshake();
+  // Reopen files. The IDs used here are below the range of any slot's.
+  reopened.clear();
+  {
+    std::lock_guard<std::mutex> g(output_lock);
+    for(auto &f : files)
+      if(!f.second.directory)
+        reopened.push_back(f);
+  }
+  for(size_t n = 0; n < reopened.size(); ++n) {
+    std::string cmd;
+    newpacket(cmd, SSH_FXP_OPEN);
+    pack32(cmd, n);                        // uint32 id
+    packstr(cmd, reopened[n].second.path); // string filename
+    pack32(cmd, reopened[n].second.mode);  // uint32 pflags
+    pack32(cmd, 0);                        // uint32 flags
+    send_now(cmd);
+  }
+  std::vector<std::string> handles(reopened.size());
+  for(size_t n = 0; n < reopened.size(); ++n) {
+    std::string body;
+    int type = recv_reply(body);
+    size_t pos = 0;
+    uint32_t id = unpack32(body, pos);
+    if(id >= reopened.size())
+      syserror(name + ": unexpected SFTP response");
+    // A file that has gone away cannot be reopened
+    if(type == SSH_FXP_HANDLE)
+      handles[id] = unpackstr(body, pos);
+  }
+  // Check that each file is the same as when it was first opened; if not,
+  // the rest of it cannot be read consistently
+  size_t checks = 0;
+  for(size_t n = 0; n < reopened.size(); ++n) {
+    if(handles[n].empty())
+      continue;
+    std::string cmd;
+    newpacket(cmd, SSH_FXP_FSTAT);
+    pack32(cmd, n);           // uint32 id
+    packstr(cmd, handles[n]); // string handle
+    send_now(cmd);
+    ++checks;
+  }
+  std::vector<std::string> changed;
+  for(size_t n = 0; n < checks; ++n) {
+    Reply reply;
+    reply.type = recv_reply(reply.body);
     size_t pos = 0;
-    uint32_t id = self->unpack32(buffer, pos);
+    uint32_t id = unpack32(reply.body, pos);
+    if(id >= reopened.size() || handles[id].empty())
+      syserror(name + ": unexpected SFTP response");
+    const Identity *was = reopened[id].second.identity.get();
+    bool same = false;
+    if(was && was->known && reply.type == SSH_FXP_ATTRS) {
+      Attributes attrs = decode_attrs(reply);
+      same = (attrs.flags & SSH_FILEXFER_ATTR_SIZE)
+             && (attrs.flags & SSH_FILEXFER_ACMODTIME)
+             && attrs.size == was->size && attrs.mtime == was->mtime;
+    }
+    if(!same) {
+      fprintf(stderr, "WARNING: %s:%s: changed during reconnect\n",
+              name.c_str(), reopened[id].second.path.c_str());
+      changed.push_back(handles[id]);
+      handles[id].clear();
+    }
+  }
+  // Release the handles of changed files
+  for(size_t n = 0; n < changed.size(); ++n) {
+    std::string cmd;
+    newpacket(cmd, SSH_FXP_CLOSE);
+    pack32(cmd, n);           // uint32 id
+    packstr(cmd, changed[n]); // string handle
+    send_now(cmd);
+  }
+  for(size_t n = 0; n < changed.size(); ++n) {
+    std::string body;
+    recv_reply(body);
+  }
+  for(size_t n = 0; n < reopened.size(); ++n)
+    reopened[n].second.server = handles[n];
+}
+
+void SFTP::Connection::finish(bool ok, const std::string &why) {
+  if(!ok) {
     {
-      if(debug)
-        fprintf(stderr, "DEBUG: %s %s stashing\n", __func__,
-                self->name.c_str());
-      std::lock_guard<std::mutex> g(self->lock);
-      // Stash the reply for collection
-      self->replies[id] = reply{ type, buffer };
-      // No longerr waiting for this ID
-      self->waiting.erase(id);
+      std::lock_guard<std::mutex> g(output_lock);
+      reconnecting = false;
+    }
+    fail(why);
+    return;
+  }
+  // Requests that must be completed without the server's help
+  std::vector<std::pair<uint32_t, uint32_t>> synthetic;
+  {
+    std::lock_guard<std::mutex> g(output_lock);
+    reconnecting = false;
+    // Files closed during the reconnect stay closed. Files that could not
+    // be reopened are kept, with no server handle, so that later requests
+    // for them are refused.
+    std::map<std::string, OpenFile> current;
+    current.swap(files);
+    aliased = 0;
+    for(auto &f : reopened) {
+      if(current.find(f.first) == current.end())
+        continue;
+      if(f.second.server != f.first)
+        ++aliased;
+      files[f.first] = f.second;
+    }
+    reopened.clear();
+    // Resend outstanding requests
+    std::lock_guard<std::mutex> locked(lock);
+    for(auto &slot : slots) {
+      if(slot->state != Slot::WAITING || !slot->request_type)
+        continue;
+      uint8_t type = slot->request_type;
+      // The old server's handles all went away with it
+      if(type == SSH_FXP_CLOSE) {
+        synthetic.push_back({ slot->id, SSH_FX_OK });
+        continue;
+      }
+      if(!has_handle(type)) {
+        next_pending() = slot->request;
+        continue;
+      }
+      std::string handle = slot->read_handle;
+      if(type != SSH_FXP_READ) {
+        size_t pos = 9;
+        handle = unpackstr(slot->request, pos);
+      }
+      auto f = files.find(handle);
+      if(f == files.end() || f->second.server.empty()) {
+        synthetic.push_back({ slot->id, SSH_FX_CONNECTION_LOST });
+        continue;
+      }
+      std::string &s = next_pending();
+      if(type == SSH_FXP_READ) {
+        newpacket(s, SSH_FXP_READ);
+        pack32(s, slot->id);          // uint32 id
+        packstr(s, f->second.server); // string handle
+        pack64(s, slot->read_offset); // uint64 offset
+        pack32(s, slot->read_len);    // uint32 len
+        uint32_t len = tobe32(s.size() - 4);
+        s.replace(0, sizeof len, (char *)&len, sizeof len);
+      } else {
+        s = slot->request;
+        rehandle(s, f->second.server);
+      }
     }
-    // Notify all the waiters
     if(debug)
-      fprintf(stderr, "DEBUG: %s %s notify\n", __func__, self->name.c_str());
-    self->cond.notify_all();
+      fprintf(stderr, "DEBUG: %s %s reopened %zu files, resending %zu\n",
+              __func__, name.c_str(), files.size(), npending);
+    if(transport.loop)
+      attach();
+    flush_locked();
+  }
+  for(auto &s : synthetic)
+    synthesize(s.first, s.second, "connection lost");
+}
+
+void SFTP::Connection::synthesize(uint32_t id, uint32_t status,
+                                  const std::string &message) {
+  std::string body;
+  Buffer data;
+  pack32(body, id);       // uint32 id
+  pack32(body, status);   // uint32 error/status code
+  packstr(body, message); // string error message
+  packstr(body, "");      // string language tag
+  deliver(SSH_FXP_STATUS, body, data, true);
+}
+
+std::string SFTP::Connection::opened(const std::string &server,
+                                     const std::string &path, bool directory,
+                                     uint32_t mode,
+                                     std::shared_ptr<Identity> identity) {
+  if(!transport.retries)
+    return server;
+  std::lock_guard<std::mutex> g(output_lock);
+  std::string handle = server;
+  while(files.find(handle) != files.end())
+    handle = server + "/" + std::to_string(++serial);
+  OpenFile &f = files[handle];
+  f.path = path;
+  f.directory = directory;
+  f.mode = mode;
+  f.server = server;
+  f.identity = identity;
+  if(handle != server)
+    ++aliased;
+  return handle;
+}
+
+void SFTP::Connection::forget(const std::string &handle) {
+  if(!transport.retries)
+    return;
+  std::lock_guard<std::mutex> g(output_lock);
+  auto it = files.find(handle);
+  if(it == files.end())
+    return;
+  if(it->second.server != it->first)
+    --aliased;
+  files.erase(it);
+}
+
+void SFTP::Connection::attach() {
+  nonblock(rfd);
+  nonblock(wfd);
+  // Anything already read goes to the new input buffer
+  rx.assign(input + input_ptr, input + input_total);
+  input_ptr = input_total = 0;
+  rx_start = 0;
+  rx_end = rx.size();
+  rx_need = 0;
+  rx_data.release();
+  rx_fill = 0;
+  write_blocked = false;
+  transport.loop->watch(rfd, EventLoop::READ, [this](unsigned) { readable(); });
+}
+
+void SFTP::Connection::readable() {
+  try {
+    for(;;) {
+      if(rx_fill < rx_data.size()) {
+        // Read the rest of a SSH_FXP_DATA payload directly into its buffer
+        ssize_t bytes_read =
+          ::read(rfd, rx_data.data() + rx_fill, rx_data.size() - rx_fill);
+        if(bytes_read < 0) {
+          if(errno == EINTR)
+            continue;
+          if(errno == EAGAIN)
+            return;
+          syserror(name + ": read", errno);
+        }
+        if(bytes_read == 0)
+          syserror(name + ": unexpected EOF");
+        rx_fill += bytes_read;
+        if(rx_fill == rx_data.size()) {
+          rx_fill = 0;
+          deliver(SSH_FXP_DATA, rx_body, rx_data);
+        }
+        continue;
+      }
+      if(parse_input())
+        continue;
+      // Make room for at least rx_need bytes and as much more as is
+      // convenient
+      if(rx_start > 0) {
+        memmove(&rx[0], &rx[rx_start], rx_end - rx_start);
+        rx_end -= rx_start;
+        rx_start = 0;
+      }
+      size_t want = std::max(rx_need, rx_end + sizeof input * 16);
+      if(rx.size() < want)
+        rx.resize(want);
+      ssize_t bytes_read = ::read(rfd, &rx[rx_end], rx.size() - rx_end);
+      if(bytes_read < 0) {
+        if(errno == EINTR)
+          continue;
+        if(errno == EAGAIN)
+          return;
+        syserror(name + ": read", errno);
+      }
+      if(bytes_read == 0)
+        syserror(name + ": unexpected EOF");
+      rx_end += bytes_read;
+    }
+  } catch(std::exception &e) {
+    transport.loop->unwatch(rfd);
+    lost(e.what());
+  }
+}
+
+bool SFTP::Connection::parse_input() {
+  size_t available = rx_end - rx_start;
+  const char *ptr = &rx[rx_start];
+  uint32_t len;
+  // Get the length and type
+  if(available < sizeof len + 1) {
+    rx_need = sizeof len + 1;
+    return false;
+  }
+  memcpy(&len, ptr, sizeof len);
+  len = frombe32(len);
+  // Length includes type so must be at least 1
+  if(len == 0)
+    syserror(name + ": 0-length reply");
+  uint8_t type = ptr[sizeof len];
+  if(type == SSH_FXP_DATA) {
+    // Get the ID and the data length
+    const size_t header = sizeof len + 1 + 8;
+    if(len < 9)
+      syserror(name + ": truncated reply");
+    if(available < header) {
+      rx_need = header;
+      return false;
+    }
+    uint32_t data_len;
+    memcpy(&data_len, ptr + header - 4, sizeof data_len);
+    data_len = frombe32(data_len);
+    if(data_len != len - 9)
+      syserror(name + ": malformed SSH_FXP_DATA");
+    rx_body.assign(ptr + sizeof len + 1, 4);
+    // Take as much of the payload as we already have; the rest is read
+    // directly into the buffer.
+    rx_data = Buffer::get(data_len);
+    rx_fill = std::min((size_t)data_len, available - header);
+    memcpy(rx_data.data(), ptr + header, rx_fill);
+    rx_start += header + rx_fill;
+    if(rx_fill == data_len) {
+      rx_fill = 0;
+      deliver(SSH_FXP_DATA, rx_body, rx_data);
+    }
+    return true;
+  }
+  if(available < sizeof len + len) {
+    rx_need = sizeof len + len;
+    return false;
+  }
+  std::string body(ptr + sizeof len + 1, len - 1);
+  Buffer data;
+  rx_start += sizeof len + len;
+  deliver(type, body, data);
+  return true;
+}
+
+void SFTP::Connection::writable() {
+  try {
+    std::lock_guard<std::mutex> g(output_lock);
+    write_blocked = false;
+    flush_locked();
+    if(!write_blocked)
+      transport.loop->unwatch(wfd);
+  } catch(std::exception &e) {
+    transport.loop->unwatch(wfd);
+    lost(e.what());
   }
 }
 
@@ -357,98 +1282,526 @@ static std::string format_handle(const std::string &handle) {
 }
 
 std::string SFTP::Connection::open(const std::string &path, uint32_t mode) {
+  return open_async(path, mode).get();
+}
+
+std::future<std::string>
+SFTP::Connection::open_async(const std::string &path, uint32_t mode,
+                             const Notify &ready) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(), path.c_str());
-  const std::string fullpath =
-    path.size() > 0 && path.at(0) == '/' ? path : home + "/" + path;
-  std::string cmd, reply, handle;
-  uint32_t id = newid();
+  const std::string fullpath = absolute(path);
+  std::string cmd;
   newpacket(cmd, SSH_FXP_OPEN);
-  pack32(cmd, id);        // uint32 id
+  pack32(cmd, 0);         // uint32 id
   packstr(cmd, fullpath); // string filename
   pack32(cmd, mode);      // uint32 path
   pack32(cmd, 0);         // uint32 flags
+  std::shared_ptr<Identity> identity;
+  if(transport.retries)
+    identity = std::make_shared<Identity>();
+  return submit<std::string>(
+    cmd,
+    [this, path, fullpath, mode, identity](Reply &reply) {
+      std::string handle = opened(decode_handle(reply, path), fullpath, false,
+                                  mode, identity);
+      if(identity)
+        identify(handle, identity);
+      return handle;
+    },
+    ready);
+}
+
+void SFTP::Connection::identify(const std::string &handle,
+                                std::shared_ptr<Identity> identity) {
+  // Ask the handle rather than the path, so that a file replaced after the
+  // open isn't mistaken for the one actually opened
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_FSTAT);
+  pack32(cmd, newid([this, identity](Reply &reply,
+                                     std::exception_ptr failure) {
+    if(failure)
+      return;
+    try {
+      Attributes attrs = decode_attrs(reply);
+      if((attrs.flags & SSH_FILEXFER_ATTR_SIZE)
+         && (attrs.flags & SSH_FILEXFER_ACMODTIME)) {
+        identity->size = attrs.size;
+        identity->mtime = attrs.mtime;
+        identity->known = true;
+      }
+    } catch(std::exception &) {
+      // The file can't be checked, so won't be reopened
+    }
+  }));                  // uint32 id
+  packstr(cmd, handle); // string handle
   send(cmd);
-  int type = await_reply(id, reply);
-  size_t pos = 4;
-  switch(type) {
-  case SSH_FXP_HANDLE:
-    handle = unpackstr(reply, pos);
-    if(debug)
-      fprintf(stderr, "DEBUG: %s %s %s -> [%s]\n", __func__, name.c_str(),
-              fullpath.c_str(), format_handle(handle).c_str());
-    return handle;
-  case SSH_FXP_STATUS:
-    error(reply, path);
-    syserror(name + ": unexpected SFTP status");
-  default: syserror(name + ": unexpected SFTP response");
-  }
+}
+
+const std::string &SFTP::Connection::home_directory() {
+  std::lock_guard<std::mutex> g(home_lock);
+  if(home.size() == 0)
+    home = realpath("");
+  return home;
+}
+
+std::string SFTP::Connection::absolute(const std::string &path) {
+  if(path.size() > 0 && path.at(0) == '/')
+    return path;
+  return home_directory() + "/" + path;
 }
 
 void SFTP::Connection::close(const std::string &handle) {
+  close_async(handle).get();
+}
+
+std::future<void> SFTP::Connection::close_async(const std::string &handle,
+                                                const Notify &ready) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s [%s]\n", __func__, name.c_str(),
             format_handle(handle).c_str());
-  std::string cmd, reply;
-  uint32_t id = newid();
+  std::string cmd;
   newpacket(cmd, SSH_FXP_CLOSE);
-  pack32(cmd, id);      // uint32 id
+  pack32(cmd, 0);       // uint32 id
+  packstr(cmd, handle); // string handle
+  std::future<void> future = submit<void>(
+    cmd, [this](Reply &reply) { decode_status(reply); }, ready);
+  forget(handle);
+  return future;
+}
+
+void SFTP::Connection::close_detached(const std::string &handle) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s [%s]\n", __func__, name.c_str(),
+            format_handle(handle).c_str());
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_CLOSE);
+  pack32(cmd, 0);       // uint32 id
   packstr(cmd, handle); // string handle
+  setid(cmd, newid([](Reply &, std::exception_ptr) {}));
   send(cmd);
-  int type = await_reply(id, reply);
-  switch(type) {
-  case SSH_FXP_STATUS: error(reply); break;
-  default: syserror(name + ": unexpected SFTP response");
-  }
+  forget(handle);
 }
 
 void SFTP::Connection::fstat(const std::string &handle, Attributes &attrs) {
+  attrs = fstat_async(handle).get();
+}
+
+std::future<SFTP::Attributes>
+SFTP::Connection::fstat_async(const std::string &handle,
+                              const Notify &ready) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s [%s]\n", __func__, name.c_str(),
             format_handle(handle).c_str());
-  std::string cmd, reply;
-  uint32_t id = newid();
+  std::string cmd;
   newpacket(cmd, SSH_FXP_FSTAT);
-  pack32(cmd, id);      // uint32 id
+  pack32(cmd, 0);       // uint32 id
   packstr(cmd, handle); // string handle
-  send(cmd);
-  int type = await_reply(id, reply);
-  size_t pos = 4;
-  switch(type) {
-  case SSH_FXP_ATTRS: attrs.unpack(*this, reply, pos); break;
-  case SSH_FXP_STATUS:
-    error(reply);
-    syserror(name + ": unexpected SFTP status");
-  default: syserror(name + ": unexpected SFTP response");
-  }
+  return submit<Attributes>(
+    cmd, [this](Reply &reply) { return decode_attrs(reply); }, ready);
+}
+
+void SFTP::Connection::stat(const std::string &path, Attributes &attrs) {
+  attrs = stat_async(path).get();
+}
+
+std::future<SFTP::Attributes>
+SFTP::Connection::stat_async(const std::string &path,
+                             const Notify &ready) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(), path.c_str());
+  const std::string fullpath = absolute(path);
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_STAT);
+  pack32(cmd, 0);         // uint32 id
+  packstr(cmd, fullpath); // string path
+  return submit<Attributes>(
+    cmd, [this](Reply &reply) { return decode_attrs(reply); }, ready);
 }
 
 std::string SFTP::Connection::realpath(const std::string &path) {
+  return realpath_async(path).get();
+}
+
+std::future<std::string>
+SFTP::Connection::realpath_async(const std::string &path,
+                                 const Notify &ready) {
   if(debug)
     fprintf(stderr, "DEBUG: %s %s [%s]\n", __func__, name.c_str(),
             path.c_str());
-  std::string cmd, reply;
-  uint32_t id = newid();
+  std::string cmd;
   newpacket(cmd, SSH_FXP_REALPATH);
-  pack32(cmd, id);    // uint32 id
+  pack32(cmd, 0);     // uint32 id
   packstr(cmd, path); // string path
-  send(cmd);
-  int type = await_reply(id, reply);
+  return submit<std::string>(
+    cmd, [this](Reply &reply) { return decode_name(reply); }, ready);
+}
+
+std::string SFTP::Connection::opendir(const std::string &path) {
+  return opendir_async(path).get();
+}
+
+std::future<std::string>
+SFTP::Connection::opendir_async(const std::string &path,
+                                const Notify &ready) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(), path.c_str());
+  const std::string fullpath = absolute(path);
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_OPENDIR);
+  pack32(cmd, 0);         // uint32 id
+  packstr(cmd, fullpath); // string path
+  return submit<std::string>(
+    cmd,
+    [this, path, fullpath](Reply &reply) {
+      return opened(decode_handle(reply, path), fullpath, true);
+    },
+    ready);
+}
+
+std::vector<SFTP::Name>
+SFTP::Connection::readdir(const std::string &handle) {
+  return readdir_async(handle).get();
+}
+
+std::future<std::vector<SFTP::Name>>
+SFTP::Connection::readdir_async(const std::string &handle,
+                                const Notify &ready) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s [%s]\n", __func__, name.c_str(),
+            format_handle(handle).c_str());
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_READDIR);
+  pack32(cmd, 0);       // uint32 id
+  packstr(cmd, handle); // string handle
+  return submit<std::vector<Name>>(
+    cmd, [this](Reply &reply) { return decode_names(reply); }, ready);
+}
+
+std::future<Buffer> SFTP::Connection::read_async(const std::string &handle,
+                                                 uint64_t offset,
+                                                 uint32_t len,
+                                                 const Notify &ready) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s [%s] %" PRIu64 " %" PRIu32 "\n", __func__,
+            name.c_str(), format_handle(handle).c_str(), offset, len);
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_READ);
+  pack32(cmd, 0);       // uint32 id
+  packstr(cmd, handle); // string handle
+  pack64(cmd, offset);  // uint64 offset
+  pack32(cmd, len);     // uint32 len
+  return submit<Buffer>(
+    cmd, [this](Reply &reply) { return decode_data(reply); }, ready);
+}
+
+void SFTP::Connection::fulfil(std::promise<void> &promise,
+                              const std::function<void(Reply &)> &decode,
+                              Reply &reply) {
+  try {
+    decode(reply);
+    promise.set_value();
+  } catch(...) {
+    promise.set_exception(std::current_exception());
+  }
+}
+
+void SFTP::Connection::setid(std::string &packet, uint32_t id) {
+  uint32_t be_id = tobe32(id);
+  packet.replace(5, sizeof be_id, (char *)&be_id, sizeof be_id);
+}
+
+std::string SFTP::Connection::decode_handle(Reply &reply,
+                                            const std::string &path) {
   size_t pos = 4;
-  switch(type) {
+  switch(reply.type) {
+  case SSH_FXP_HANDLE: {
+    std::string handle = unpackstr(reply.body, pos);
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s %s -> [%s]\n", __func__, name.c_str(),
+              path.c_str(), format_handle(handle).c_str());
+    return handle;
+  }
+  case SSH_FXP_STATUS:
+    error(reply.body, path);
+    syserror(name + ": unexpected SFTP status");
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+void SFTP::Connection::decode_status(Reply &reply) {
+  switch(reply.type) {
+  case SSH_FXP_STATUS: error(reply.body); break;
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+SFTP::Attributes SFTP::Connection::decode_attrs(Reply &reply) {
+  Attributes attrs;
+  size_t pos = 4;
+  switch(reply.type) {
+  case SSH_FXP_ATTRS: attrs.unpack(*this, reply.body, pos); return attrs;
+  case SSH_FXP_STATUS:
+    error(reply.body);
+    syserror(name + ": unexpected SFTP status");
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+std::string SFTP::Connection::decode_name(Reply &reply) {
+  size_t pos = 4;
+  switch(reply.type) {
   case SSH_FXP_NAME: {
-    uint32_t names = unpack32(reply, pos); // uint32 count
+    uint32_t names = unpack32(reply.body, pos); // uint32 count
     if(names != 1)
       syserror(name + ": unexpected SFTP response");
-    return unpackstr(reply, pos); // string name
+    return unpackstr(reply.body, pos); // string name
+  }
+  case SSH_FXP_STATUS:
+    error(reply.body);
+    syserror(name + ": unexpected SFTP status");
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+std::vector<SFTP::Name> SFTP::Connection::decode_names(Reply &reply) {
+  std::vector<Name> names;
+  size_t pos = 4;
+  switch(reply.type) {
+  case SSH_FXP_NAME: {
+    uint32_t count = unpack32(reply.body, pos); // uint32 count
+    // Each entry is at least 12 bytes
+    if(count > (reply.body.size() - pos) / 12)
+      syserror(name + ": malformed SSH_FXP_NAME");
+    names.resize(count);
+    for(auto &n : names) {
+      n.filename = unpackstr(reply.body, pos); // string filename
+      n.longname = unpackstr(reply.body, pos); // string longname
+      n.attrs.unpack(*this, reply.body, pos);  // ATTRS attrs
+    }
+    return names;
+  }
+  case SSH_FXP_STATUS:
+    if(unpack32(reply.body, pos) == SSH_FX_EOF)
+      return names;
+    error(reply.body);
+    syserror(name + ": unexpected SFTP status");
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+Buffer SFTP::Connection::decode_data(Reply &reply) {
+  size_t pos = 4;
+  switch(reply.type) {
+  case SSH_FXP_DATA: return std::move(reply.data); // string data
+  case SSH_FXP_STATUS:
+    if(unpack32(reply.body, pos) == SSH_FX_EOF)
+      return Buffer();
+    error(reply.body);
+    syserror(name + ": unexpected SFTP status");
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
+bool SFTP::Connection::extension(const std::string &ext,
+                                 std::string *data) const {
+  auto it = extensions.find(ext);
+  if(it == extensions.end())
+    return false;
+  if(data)
+    *data = it->second;
+  return true;
+}
+
+std::string SFTP::Connection::digest(const std::string &path) {
+  const std::string fullpath = absolute(path);
+  std::string digest = check_file(fullpath);
+  if(digest.empty())
+    digest = remote_sha256sum(fullpath);
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s %s\n", __func__, name.c_str(),
+            fullpath.c_str(), digest.size() ? digest.c_str() : "(none)");
+  return digest;
+}
+
+std::string SFTP::Connection::check_file(const std::string &path) {
+  std::string algorithms;
+  if(!extension("check-file-name", &algorithms)
+     && !extension("check-file", &algorithms))
+    return "";
+  // If the server says which algorithms it supports, SHA-256 must be one
+  if(algorithms.size()
+     && ("," + algorithms + ",").find(",sha256,") == std::string::npos)
+    return "";
+  std::string cmd;
+  newpacket(cmd, SSH_FXP_EXTENDED);
+  pack32(cmd, 0);                  // uint32 id
+  packstr(cmd, "check-file-name"); // string extended-request
+  packstr(cmd, path);              // string filename
+  packstr(cmd, "sha256");          // string hash-algorithm-list
+  pack64(cmd, 0);                  // uint64 start-offset
+  pack64(cmd, 0);                  // uint64 length (0 means to the end)
+  pack32(cmd, 0);                  // uint32 block-size (0 means one hash)
+  try {
+    return submit<std::string>(
+             cmd,
+             [this](Reply &reply) { return decode_check_file(reply); },
+             Notify())
+      .get();
+  } catch(std::runtime_error &e) {
+    // The caller can fall back to another method
+    if(debug)
+      fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(), e.what());
+    return "";
+  }
+}
+
+std::string SFTP::Connection::decode_check_file(Reply &reply) {
+  size_t pos = 4;
+  switch(reply.type) {
+  case SSH_FXP_EXTENDED_REPLY: {
+    // Some servers precede the algorithm with the extension name
+    std::string algorithm = unpackstr(reply.body, pos); // string hash-algo
+    if(algorithm == "check-file")
+      algorithm = unpackstr(reply.body, pos);
+    if(algorithm != "sha256" || reply.body.size() - pos != Sha256::SIZE)
+      return "";
+    static const char hexdigits[] = "0123456789abcdef";
+    std::string digest;
+    for(; pos < reply.body.size(); ++pos) { // byte hash[hash-length]
+      uint8_t byte = reply.body[pos];
+      digest += hexdigits[byte >> 4];
+      digest += hexdigits[byte & 15];
+    }
+    return digest;
   }
   case SSH_FXP_STATUS:
-    error(reply);
+    error(reply.body);
     syserror(name + ": unexpected SFTP status");
   default: syserror(name + ": unexpected SFTP response");
   }
 }
 
+std::string SFTP::Connection::remote_sha256sum(const std::string &path) {
+  // Redirection avoids sha256sum's escaping of awkward filenames
+  std::string output;
+  if(!execute("sha256sum < " + shell_quote(path) + " 2>/dev/null", output))
+    return "";
+  // The output is the digest followed by "  -"
+  std::string digest = output.substr(0, 64);
+  if(digest.size() != 64
+     || digest.find_first_not_of("0123456789abcdef") != std::string::npos)
+    return "";
+  return digest;
+}
+
+bool SFTP::Connection::execute(const std::string &cmd, std::string &output) {
+  if(transport.sftp_command.size())
+    return false;
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(), cmd.c_str());
+  std::vector<std::string> args = ssh_command();
+  args.push_back(name);
+  args.push_back(cmd);
+  std::vector<const char *> cargs;
+  for(auto &a : args)
+    cargs.push_back(a.c_str());
+  cargs.push_back(nullptr);
+  int p[2];
+  if(pipe(p) < 0)
+    syserror("pipe");
+  pid_t child = fork();
+  if(child < 0) {
+    int save_errno = errno;
+    ::close(p[0]);
+    ::close(p[1]);
+    syserror("fork", save_errno);
+  }
+  if(child == 0) {
+    signal(SIGPIPE, SIG_DFL);
+    int null = ::open("/dev/null", O_RDONLY);
+    if(null < 0 || dup2(null, 0) < 0 || dup2(p[1], 1) < 0) {
+      fprintf(stderr, "ERROR: dup2: %s\n", strerror(errno));
+      _Exit(2);
+    }
+    ::close(p[0]);
+    ::close(p[1]);
+    execvp(cargs[0], (char **)&cargs[0]);
+    fprintf(stderr, "ERROR: execvp %s %s: %s\n", cargs[0], name.c_str(),
+            strerror(errno));
+    _Exit(2);
+  }
+  ::close(p[1]);
+  output.clear();
+  char buffer[65536];
+  ssize_t n;
+  while((n = readall(p[0], buffer, sizeof buffer)) > 0)
+    output.append(buffer, n);
+  int save_errno = errno;
+  ::close(p[0]);
+  int status;
+  while(waitpid(child, &status, 0) < 0)
+    if(errno != EINTR)
+      syserror("waitpid");
+  if(n < 0)
+    syserror(name + ": reading command output", save_errno);
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s status %#x, %zu bytes\n", __func__,
+            name.c_str(), status, output.size());
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void SFTP::Connection::limits() {
+  std::string cmd;
+  uint32_t id = newid();
+  newpacket(cmd, SSH_FXP_EXTENDED);
+  pack32(cmd, id);                    // uint32 id
+  packstr(cmd, "limits@openssh.com"); // string extended-request
+  send(cmd);
+  std::lock_guard<std::mutex> g(limits_lock);
+  limits_id = id;
+  limits_pending = true;
+}
+
+void SFTP::Connection::collect_limits() {
+  std::lock_guard<std::mutex> g(limits_lock);
+  if(!limits_pending)
+    return;
+  limits_pending = false;
+  std::string reply;
+  int type = await_reply(limits_id, reply);
+  size_t pos = 4;
+  switch(type) {
+  case SSH_FXP_EXTENDED_REPLY: {
+    unpack64(reply, pos);                     // uint64 max-packet-length
+    uint64_t max_read = unpack64(reply, pos); // uint64 max-read-length
+    unpack64(reply, pos);                     // uint64 max-write-length
+    open_handles = unpack64(reply, pos);      // uint64 max-open-handles
+    // 0 means no limit
+    if(max_read == 0 || max_read > MAX_READ_LENGTH)
+      max_read = MAX_READ_LENGTH;
+    read_length = max_read;
+    if(debug)
+      fprintf(stderr,
+              "DEBUG: %s %s max-read-length=%" PRIu32
+              " max-open-handles=%" PRIu64 "\n",
+              __func__, name.c_str(), read_length, open_handles);
+    break;
+  }
+  case SSH_FXP_STATUS:
+    // Stick with the defaults if the server changed its mind
+    try {
+      error(reply);
+    } catch(Error &e) {
+      if(debug)
+        fprintf(stderr, "DEBUG: %s %s %s\n", __func__, name.c_str(),
+                e.what());
+    }
+    break;
+  default: syserror(name + ": unexpected SFTP response");
+  }
+}
+
 uint32_t SFTP::Connection::begin_read(const std::string &handle,
                                       uint64_t offset, uint32_t len) {
   std::string cmd;
@@ -466,21 +1819,104 @@ uint32_t SFTP::Connection::begin_read(const std::string &handle,
   return id;
 }
 
-std::string SFTP::Connection::finish_read(uint32_t id) {
+uint32_t SFTP::Connection::forward(std::string &packet) {
+  if(packet.size() < 9)
+    throw std::runtime_error(name + ": malformed request");
+  uint32_t id = newid();
+  setid(packet, id);
+  send(packet);
+  return id;
+}
+
+int SFTP::Connection::await_forwarded(uint32_t id, std::string &body,
+                                      Buffer &data) {
+  return await_reply(id, body, &data);
+}
+
+bool SFTP::Connection::failed() {
+  std::lock_guard<std::mutex> g(lock);
+  return failure.size() > 0;
+}
+
+void SFTP::Connection::read_template(const std::string &handle,
+                                     ReadTemplate &t) {
+  newpacket(t.packet, SSH_FXP_READ);
+  pack32(t.packet, 0);       // uint32 id
+  packstr(t.packet, handle); // string handle
+  pack64(t.packet, 0);       // uint64 offset
+  pack32(t.packet, 0);       // uint32 len
+  uint32_t len = tobe32(t.packet.size() - 4);
+  t.packet.replace(0, sizeof len, (char *)&len, sizeof len);
+  t.handle = handle;
+}
+
+uint32_t SFTP::Connection::queue_read(const ReadTemplate &t, uint64_t offset,
+                                      uint32_t len) {
+  Slot *slot = newslot(Completion());
+  uint32_t id = slot->id;
+  enqueue_read(t, offset, len, slot);
+  return id;
+}
+
+uint32_t SFTP::Connection::queue_read(const ReadTemplate &t, uint64_t offset,
+                                      uint32_t len,
+                                      ReadCompletion completion) {
+  Slot *slot = newslot([this, completion](Reply &reply,
+                                          std::exception_ptr failure) {
+    Buffer data;
+    if(!failure) {
+      try {
+        data = decode_data(reply);
+      } catch(...) {
+        failure = std::current_exception();
+      }
+    }
+    completion(data, failure);
+  });
+  uint32_t id = slot->id;
+  enqueue_read(t, offset, len, slot);
+  return id;
+}
+
+void SFTP::Connection::enqueue_read(const ReadTemplate &t, uint64_t offset,
+                                    uint32_t len, Slot *slot) {
+  uint32_t id = slot->id;
   if(debug)
-    fprintf(stderr, "DEBUG: %s %s %#" PRIx32 "\n", __func__, name.c_str(), id);
-  std::string reply;
-  int type = await_reply(id, reply);
-  size_t pos = 4;
-  switch(type) {
-  case SSH_FXP_DATA: return unpackstr(reply, pos); // string data
-  case SSH_FXP_STATUS:
-    if(unpack32(reply, pos) == SSH_FX_EOF)
-      return "";
-    error(reply);
-    syserror(name + ": unexpected SFTP status");
-  default: syserror(name + ": unexpected SFTP response");
+    fprintf(stderr, "DEBUG: %s %s %" PRIu64 " %" PRIu32 " %#" PRIx32 "\n",
+            __func__, name.c_str(), offset, len, id);
+  std::unique_lock<std::mutex> locked(output_lock);
+  if(transport.retries) {
+    // Enough to rebuild the request after a reconnect, without copying it
+    slot->request_type = SSH_FXP_READ;
+    slot->read_handle = t.handle;
+    slot->read_offset = offset;
+    slot->read_len = len;
+    // The read will be sent when the reconnect completes
+    if(reconnecting)
+      return;
   }
+  std::string &s = next_pending();
+  s.assign(t.packet);
+  // Patch in the ID, offset and length
+  size_t end = s.size();
+  uint32_t be_id = tobe32(id), be_len = tobe32(len);
+  uint64_t be_offset = tobe64(offset);
+  s.replace(5, sizeof be_id, (char *)&be_id, sizeof be_id);
+  s.replace(end - 12, sizeof be_offset, (char *)&be_offset, sizeof be_offset);
+  s.replace(end - 4, sizeof be_len, (char *)&be_len, sizeof be_len);
+  if(!prepare(s)) {
+    --npending;
+    locked.unlock();
+    unsendable(id, SSH_FXP_READ);
+  }
+}
+
+Buffer SFTP::Connection::finish_read(uint32_t id) {
+  if(debug)
+    fprintf(stderr, "DEBUG: %s %s %#" PRIx32 "\n", __func__, name.c_str(), id);
+  Reply reply;
+  reply.type = await_reply(id, reply.body, &reply.data);
+  return decode_data(reply);
 }
 
 void SFTP::Attributes::unpack(const SFTP::Connection &c, std::string &reply,
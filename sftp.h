@@ -24,11 +24,17 @@
 #include <config.h>
 #include <string>
 #include <map>
-#include <set>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "scheduler.h"
 
 #define SSH_FXF_READ 0x00000001
 #define SSH_FXF_WRITE 0x00000002
@@ -71,9 +77,78 @@
 #define SSH_FX_GROUP_INVALID 30
 #define SSH_FX_NO_MATCHING_BYTE_RANGE_LOCK 31
 
+class EventLoop;
+
 namespace SFTP {
 
 class Attributes;
+struct Name;
+
+/** @brief How to reach SFTP servers */
+struct Transport {
+  /** @brief @c ControlPersist setting for SSH connection sharing
+   *
+   * If this is empty, each connection runs its own SSH session.
+   * Otherwise connections use an OpenSSH control master per host, creating
+   * it if necessary, and it persists as specified (e.g. @c 10m) after the
+   * last connection using it has gone away.
+   */
+  std::string control_persist;
+
+  /** @brief Command to run the SFTP server instead of @c ssh
+   *
+   * If this is not empty, it is run with @c /bin/sh and its standard input
+   * and output are used as the SFTP session. Any @c %h is replaced with the
+   * hostname, quoted for the shell, and @c %% with a single @c %.
+   *
+   * Connections made this way do not use the agent.
+   */
+  std::string sftp_command;
+
+  /** @brief Use the agent if one is running
+   *
+   * See @ref Agent.
+   */
+  bool agent = true;
+
+  /** @brief Event loop to drive connections
+   *
+   * If this is a null pointer, each connection has its own thread to
+   * receive replies. Otherwise all connections are driven by this loop,
+   * with non-blocking I/O.
+   */
+  EventLoop *loop = nullptr;
+
+  /** @brief Number of times a connection may reconnect
+   *
+   * If the connection to a server is lost, it is re-established, open
+   * files are reopened and outstanding requests are sent again. This is
+   * the number of attempts made each time the connection is lost; the count
+   * starts again once the server has replied. 0 disables reconnection.
+   */
+  unsigned retries = 3;
+
+  /** @brief Return the directory for control and agent sockets
+   * @param create Whether to create the directory
+   * @return Directory name, or an empty string if @p create is @c false and
+   * the directory is missing or unsafe
+   *
+   * If @p create is @c true the directory is created if it does not exist,
+   * and an unsafe directory is an error.
+   */
+  static std::string runtime_directory(bool create = true);
+
+  /** @brief Return the path to the agent socket
+   * @param create Whether to create the runtime directory
+   * @return Socket path, or an empty string if @p create is @c false and
+   * the runtime directory is missing or unsafe
+   */
+  static std::string agent_socket(bool create = true);
+};
+
+/** @brief Extension used in @ref SSH_FXP_INIT to name the agent's target
+ * host */
+#define AGENT_HOST_EXTENSION "host@remdiff.greenend.org.uk"
 
 /** @brief Connection to an SFTP server
  *
@@ -81,6 +156,18 @@ class Attributes;
  * connection. Thereafter you can use @ref open and the other
  * methods to access files.
  *
+ * Each operation has an asynchronous form (@ref open_async, etc) which
+ * sends the request and returns a future at once. The future is made
+ * ready by the poll thread when the reply arrives, so many requests can be
+ * outstanding without any thread waiting for them. The blocking forms
+ * wait for the corresponding future.
+ *
+ * If the server goes away (for instance because the SSH session drops)
+ * then the connection is re-established, files are reopened by name and
+ * outstanding requests are sent again, transparently to the caller; see
+ * @ref Transport::retries. Directory handles cannot be recovered, so
+ * outstanding @ref readdir calls fail.
+ *
  * It is not necessary to explicitly call @ref disconnect; the
  * session will be automatically disconnected by the destructor.
  */
@@ -88,11 +175,13 @@ class Connection {
 public:
   /** @brief Construct a disconnected SFTP server
    * @param name Hostname (must be acceptable to @c ssh)
+   * @param transport How to reach the server
    *
    * The object is initially not connected; you must called @ref
    * connect.
    */
-  Connection(const std::string &name);
+  Connection(const std::string &name,
+             const Transport &transport = Transport());
 
   /** @brief Destruct the SFTP connection */
   ~Connection();
@@ -109,6 +198,13 @@ public:
    */
   void disconnect();
 
+  /** @brief Notification that a future has become ready
+   *
+   * This is called from the thread that receives replies (the event loop,
+   * if there is one) and must not block.
+   */
+  typedef std::function<void()> Notify;
+
   /** @brief Open a remote file
    * @param path Remote filename
    * @param mode Open mode
@@ -118,23 +214,109 @@ public:
    */
   std::string open(const std::string &path, uint32_t mode);
 
+  /** @brief Open a remote file asynchronously
+   * @param path Remote filename
+   * @param mode Open mode
+   * @param ready Called when the future becomes ready
+   * @return Future for the handle
+   */
+  std::future<std::string> open_async(const std::string &path, uint32_t mode,
+                                      const Notify &ready = Notify());
+
   /** @brief Close a remote file
    * @param handle Handle as returned by @ref open
    */
   void close(const std::string &handle);
 
+  /** @brief Close a remote file asynchronously
+   * @param handle Handle as returned by @ref open
+   * @param ready Called when the future becomes ready
+   * @return Future for completion
+   */
+  std::future<void> close_async(const std::string &handle,
+                                const Notify &ready = Notify());
+
+  /** @brief Close a remote file without waiting for the reply
+   * @param handle Handle as returned by @ref open
+   *
+   * Any error is ignored.
+   */
+  void close_detached(const std::string &handle);
+
   /** @brief Get remote file information
    * @param handle Handle as returned by @ref open
    * @param attrs Attributes of remote file
    */
   void fstat(const std::string &handle, Attributes &attrs);
 
+  /** @brief Get remote file information asynchronously
+   * @param handle Handle as returned by @ref open
+   * @param ready Called when the future becomes ready
+   * @return Future for the attributes of the remote file
+   */
+  std::future<Attributes> fstat_async(const std::string &handle,
+                                      const Notify &ready = Notify());
+
+  /** @brief Get remote file information by name
+   * @param path Remote filename
+   * @param attrs Attributes of remote file
+   *
+   * Symbolic links are followed.
+   */
+  void stat(const std::string &path, Attributes &attrs);
+
+  /** @brief Get remote file information by name asynchronously
+   * @param path Remote filename
+   * @param ready Called when the future becomes ready
+   * @return Future for the attributes of the remote file
+   *
+   * Symbolic links are followed.
+   */
+  std::future<Attributes> stat_async(const std::string &path,
+                                     const Notify &ready = Notify());
+
   /** @brief Get full path
    * @param path Filename
    * @return Full filename
    */
   std::string realpath(const std::string &path);
 
+  /** @brief Get full path asynchronously
+   * @param path Filename
+   * @param ready Called when the future becomes ready
+   * @return Future for the full filename
+   */
+  std::future<std::string> realpath_async(const std::string &path,
+                                          const Notify &ready = Notify());
+
+  /** @brief Open a remote directory
+   * @param path Remote directory name
+   * @return Handle for @ref readdir
+   */
+  std::string opendir(const std::string &path);
+
+  /** @brief Open a remote directory asynchronously
+   * @param path Remote directory name
+   * @param ready Called when the future becomes ready
+   * @return Future for the handle
+   */
+  std::future<std::string> opendir_async(const std::string &path,
+                                         const Notify &ready = Notify());
+
+  /** @brief Read directory entries
+   * @param handle Handle as returned by @ref opendir
+   * @return Some directory entries, or an empty vector at the end
+   */
+  std::vector<Name> readdir(const std::string &handle);
+
+  /** @brief Read directory entries asynchronously
+   * @param handle Handle as returned by @ref opendir
+   * @param ready Called when the future becomes ready
+   * @return Future for some directory entries, or an empty vector at the end
+   */
+  std::future<std::vector<Name>>
+  readdir_async(const std::string &handle, const Notify &ready = Notify());
+
   /** @brief Initiate a read
    * @param handle Handle as returned by @ref open
    * @param offset Offset within file
@@ -143,21 +325,311 @@ public:
    */
   uint32_t begin_read(const std::string &handle, uint64_t offset, uint32_t len);
 
+  /** @brief Pre-encoded @ref SSH_FXP_READ packet for one handle
+   *
+   * Use @ref read_template to initialize a template and then @ref
+   * queue_read to issue reads with it.
+   */
+  class ReadTemplate {
+  private:
+    /** @brief Packet, with placeholders for the ID, offset and length */
+    std::string packet;
+
+    /** @brief Handle as returned by @ref open */
+    std::string handle;
+    friend class Connection;
+  };
+
+  /** @brief Initialize a read template
+   * @param handle Handle as returned by @ref open
+   * @param t Template to initialize
+   */
+  void read_template(const std::string &handle, ReadTemplate &t);
+
+  /** @brief Queue a read
+   * @param t Template for the handle to read from
+   * @param offset Offset within file
+   * @param len Length to read
+   * @return ID for @ref finish_read
+   *
+   * The read is not sent until the next call to @ref flush (or any other
+   * method which sends a request). Callers must flush before waiting for
+   * the result.
+   */
+  uint32_t queue_read(const ReadTemplate &t, uint64_t offset, uint32_t len);
+
+  /** @brief Completion callback for a read
+   *
+   * The first argument is the data read, which is empty on EOF. The second
+   * is a null pointer on success, and otherwise holds the error.
+   */
+  typedef std::function<void(Buffer &, std::exception_ptr)> ReadCompletion;
+
+  /** @brief Queue a read with a completion callback
+   * @param t Template for the handle to read from
+   * @param offset Offset within file
+   * @param len Length to read
+   * @param completion Called when the read completes
+   *
+   * @p completion is called from the thread that receives replies (the
+   * event loop, if there is one) and must not block.
+   *
+   * As with the other overload, the read is not sent until the next call to
+   * @ref flush.
+   *
+   * @return ID, for @ref abandon
+   */
+  uint32_t queue_read(const ReadTemplate &t, uint64_t offset, uint32_t len,
+                      ReadCompletion completion);
+
+  /** @brief Send all queued requests
+   *
+   * All queued requests are sent with a single system call where possible.
+   */
+  void flush();
+
+  /** @brief Abandon a request
+   * @param id ID of request
+   * @return @c true if the request was abandoned, @c false if it is not
+   * outstanding
+   *
+   * The reply is discarded as soon as it arrives (or immediately, if it
+   * already has). If the request has a completion function, it is
+   * destroyed without being called.
+   *
+   * If this returns @c false then the completion function, if any, has
+   * already been called or is being called.
+   */
+  bool abandon(uint32_t id);
+
   /** @brief Complete a read
    * @param id ID from begin_read
    * @return Bytes read
    *
-   * On EOF, returns an empty string.
+   * On EOF, returns an empty buffer.
+   *
+   * The data is read directly from the server into the returned buffer,
+   * without any intermediate copies.
+   */
+  Buffer finish_read(uint32_t id);
+
+  /** @brief Read asynchronously
+   * @param handle Handle as returned by @ref open
+   * @param offset Offset within file
+   * @param len Length to read
+   * @param ready Called when the future becomes ready
+   * @return Future for the bytes read
+   *
+   * On EOF, the result is an empty buffer.
+   *
+   * For bulk transfers, @ref queue_read and @ref finish_read are more
+   * efficient.
+   */
+  std::future<Buffer> read_async(const std::string &handle, uint64_t offset,
+                                 uint32_t len, const Notify &ready = Notify());
+
+  /** @brief Get the SHA-256 digest of a remote file
+   * @param path Remote filename
+   * @return Digest in lower-case hex, or an empty string if it could not be
+   * found
+   *
+   * No file data is transferred. If the server supports the @c
+   * check-file-name extension, it is asked for the digest. Otherwise, unless
+   * @ref Transport::sftp_command is in use, @c sha256sum is run on the
+   * host in a separate SSH session.
+   */
+  std::string digest(const std::string &path);
+
+  /** @brief Run a command on the host
+   * @param cmd Shell command
+   * @param output Where to store the command's standard output
+   * @return @c true if the command succeeded
+   *
+   * The command runs in a separate SSH session, with its standard input
+   * redirected from @c /dev/null. This is not possible if @ref
+   * Transport::sftp_command is in use, in which case @c false is returned.
+   */
+  bool execute(const std::string &cmd, std::string &output);
+
+  /** @brief Test whether the server supports an extension
+   * @param ext Extension name
+   * @param data Where to store extension data, or @c nullptr
+   * @return @c true if the server advertised @p ext
+   */
+  bool extension(const std::string &ext, std::string *data = nullptr) const;
+
+  /** @brief Return all the extensions advertised by the server */
+  const std::map<std::string, std::string> &extension_map() const {
+    return extensions;
+  }
+
+  /** @brief Forward a request packet
+   * @param packet Complete request packet
+   * @return ID for @ref await_forwarded
+   *
+   * The ID in @p packet is replaced with a newly allocated one. The
+   * contents of @p packet are consumed.
+   */
+  uint32_t forward(std::string &packet);
+
+  /** @brief Wait for the reply to a forwarded request
+   * @param id ID from @ref forward
+   * @param body Reply body (excluding type and length)
+   * @param data Payload of a @ref SSH_FXP_DATA reply
+   * @return Reply type
+   *
+   * If the reply type is @ref SSH_FXP_DATA then @p body contains only the
+   * ID, and the payload is returned in @p data.
+   */
+  int await_forwarded(uint32_t id, std::string &body, Buffer &data);
+
+  /** @brief Return the event loop driving this connection, if any */
+  EventLoop *event_loop() const {
+    return transport.loop;
+  }
+
+  /** @brief Return the scheduler for reads on this connection */
+  Scheduler &scheduler() {
+    return read_scheduler;
+  }
+
+  /** @brief Return @c true if the connection has failed
+   *
+   * A connection only fails once it cannot be re-established (see @ref
+   * Transport::retries). A failed connection stays failed; all subsequent
+   * operations on it will raise an exception.
    */
-  std::string finish_read(uint32_t id);
+  bool failed();
+
+  /** @brief Maximum length for a single read
+   *
+   * This is the server's limit if it supports @c limits@openssh.com, and
+   * otherwise a conservative default. Either way it is capped at @ref
+   * MAX_READ_LENGTH.
+   *
+   * The limits query is issued during @ref connect but its reply is only
+   * awaited when the result is first needed.
+   */
+  uint32_t max_read_length() {
+    collect_limits();
+    return read_length;
+  }
+
+  /** @brief Maximum number of open handles
+   * @return Server's limit, or 0 if unknown
+   */
+  uint64_t max_open_handles() {
+    collect_limits();
+    return open_handles;
+  }
+
+  /** @brief Read length to assume if server does not advertise one */
+  static const uint32_t DEFAULT_READ_LENGTH = 32768;
+
+  /** @brief Largest read length that will ever be used */
+  static const uint32_t MAX_READ_LENGTH = 255 * 1024;
 
 private:
   /** @brief Hostname */
   std::string name;
 
-  /** @brief Home directory */
+  /** @brief How to reach the server */
+  Transport transport;
+
+  /** @brief Construct the command to run the SFTP server
+   * @return Argument list
+   */
+  std::vector<std::string> command() const;
+
+  /** @brief Construct the start of an @c ssh command line
+   * @return Argument list, lacking the hostname
+   */
+  std::vector<std::string> ssh_command() const;
+
+  /** @brief Ask the server for a SHA-256 digest
+   * @param path Absolute remote filename
+   * @return Digest in hex, or an empty string if the server could not
+   * provide one
+   */
+  std::string check_file(const std::string &path);
+
+  /** @brief Compute a SHA-256 digest with a remote command
+   * @param path Absolute remote filename
+   * @return Digest in hex, or an empty string if the command failed
+   */
+  std::string remote_sha256sum(const std::string &path);
+
+  /** @brief Start an SFTP server subprocess
+   *
+   * Sets @c rfd, @c wfd and @c pid.
+   */
+  void spawn();
+
+  /** @brief Connect to the agent
+   * @return @c true on success, @c false if no agent is running
+   *
+   * Sets @c rfd and @c wfd.
+   */
+  bool connect_agent();
+
+  /** @brief Start a session and negotiate the protocol version
+   * @return Extensions advertised by the server
+   *
+   * Starts a server subprocess, or connects to the agent, and exchanges
+   * @ref SSH_FXP_INIT and @ref SSH_FXP_VERSION.
+   *
+   * Must be called with @c output_lock held, or from a reconnect.
+   */
+  std::map<std::string, std::string> handshake();
+
+  /** @brief Home directory
+   *
+   * Use @ref home_directory to access this.
+   */
   std::string home;
 
+  /** @brief Lock protecting @c home */
+  std::mutex home_lock;
+
+  /** @brief Return the home directory
+   *
+   * The home directory is looked up the first time it is needed.
+   */
+  const std::string &home_directory();
+
+  /** @brief Convert a path to an absolute path
+   * @param path Path relative to home directory
+   * @return Absolute path
+   */
+  std::string absolute(const std::string &path);
+
+  /** @brief Extensions advertised by the server */
+  std::map<std::string, std::string> extensions;
+
+  /** @brief Maximum read length */
+  uint32_t read_length = DEFAULT_READ_LENGTH;
+
+  /** @brief Maximum open handles, or 0 if unknown */
+  uint64_t open_handles = 0;
+
+  /** @brief Lock protecting limits */
+  std::mutex limits_lock;
+
+  /** @brief Set while waiting for a @c limits@openssh.com reply */
+  bool limits_pending = false;
+
+  /** @brief ID of outstanding @c limits@openssh.com request */
+  uint32_t limits_id;
+
+  /** @brief Query server limits using @c limits@openssh.com
+   *
+   * The reply is collected by @ref collect_limits.
+   */
+  void limits();
+
+  /** @brief Collect the reply to @ref limits, if it is outstanding */
+  void collect_limits();
+
   /** @brief Read pipe */
   int rfd = -1;
 
@@ -176,6 +648,25 @@ private:
   /** @brief Bytes cobnsumed from @c input */
   size_t input_ptr;
 
+  /** @brief A reply, as delivered to a @ref Completion */
+  struct Reply {
+    /** @brief Reply packet type */
+    int type = 0;
+
+    /** @brief Reply packet body */
+    std::string body;
+
+    /** @brief Payload of a @ref SSH_FXP_DATA reply */
+    Buffer data;
+  };
+
+  /** @brief Completion function for a request
+   *
+   * The second argument is a null pointer if the reply arrived, and
+   * otherwise describes why it never will.
+   */
+  typedef std::function<void(Reply &, std::exception_ptr)> Completion;
+
   /** @brief Start a new command
    * @param s Packet being constructed
    * @param type Packet type
@@ -191,10 +682,139 @@ private:
 
   /** @brief Get a new ID
    *
-   * Registers the ID in @c waiting,
-   * both to present re-use and so that the poll knows to look for a reply.
+   * Allocates a slot for the ID in @c slots, both to prevent re-use and so
+   * that the poll thread knows to look for a reply.
+   *
+   * The low @ref SLOT_BITS of an ID are an index into @c slots; the rest
+   * are a generation number, so that a stray reply to an ID that has been
+   * abandoned is not confused with a reply to its slot's next user.
+   *
+   * If @p completion is set then it is invoked by the poll thread with the
+   * reply, and the slot is freed automatically. Otherwise the reply must
+   * be collected with @ref await_reply.
+   */
+  uint32_t newid(Completion completion = Completion());
+
+  struct Slot;
+
+  /** @brief Get a new ID and its slot
+   * @param completion As for @ref newid
+   * @return Slot for the new ID
+   */
+  Slot *newslot(Completion completion);
+
+  /** @brief Send a request whose reply will fulfil a future
+   * @param packet Complete request packet, with a placeholder ID
+   * @param decode Function to convert the reply to a result
+   * @param ready Called when the future becomes ready
+   * @return Future for the result
+   *
+   * @p decode is called in the poll thread. If it raises an exception,
+   * the future holds that exception.
+   */
+  template <typename T>
+  std::future<T> submit(std::string &packet, std::function<T(Reply &)> decode,
+                        const Notify &ready) {
+    std::shared_ptr<std::promise<T>> promise =
+      std::make_shared<std::promise<T>>();
+    std::future<T> future = promise->get_future();
+    uint32_t id =
+      newid([promise, decode, ready](Reply &reply,
+                                     std::exception_ptr failure) {
+        if(failure)
+          promise->set_exception(failure);
+        else
+          fulfil(*promise, decode, reply);
+        if(ready)
+          ready();
+      });
+    setid(packet, id);
+    send(packet);
+    return future;
+  }
+
+  /** @brief Fulfil a promise from a reply
+   * @param promise Promise to fulfil
+   * @param decode Function to convert the reply to a result
+   * @param reply Reply
+   */
+  template <typename T>
+  static void fulfil(std::promise<T> &promise,
+                     const std::function<T(Reply &)> &decode, Reply &reply) {
+    try {
+      promise.set_value(decode(reply));
+    } catch(...) {
+      promise.set_exception(std::current_exception());
+    }
+  }
+
+  /** @brief Fulfil a promise from a reply with no result
+   * @param promise Promise to fulfil
+   * @param decode Function to check the reply
+   * @param reply Reply
+   */
+  static void fulfil(std::promise<void> &promise,
+                     const std::function<void(Reply &)> &decode,
+                     Reply &reply);
+
+  /** @brief Add a read to the output queue
+   * @param t Template for the handle to read from
+   * @param offset Offset within file
+   * @param len Length to read
+   * @param slot Slot for the read, as returned by @ref newslot
+   */
+  void enqueue_read(const ReadTemplate &t, uint64_t offset, uint32_t len,
+                    Slot *slot);
+
+  /** @brief Replace the ID in a request packet
+   * @param packet Request packet
+   * @param id New ID
+   */
+  static void setid(std::string &packet, uint32_t id);
+
+  /** @brief Decode a @ref SSH_FXP_HANDLE reply
+   * @param reply Reply
+   * @param path Filename (for error messages)
+   * @return Handle
+   */
+  std::string decode_handle(Reply &reply, const std::string &path);
+
+  /** @brief Decode a @ref SSH_FXP_STATUS reply
+   * @param reply Reply
+   *
+   * Raises an exception if the status is an error.
+   */
+  void decode_status(Reply &reply);
+
+  /** @brief Decode a @ref SSH_FXP_ATTRS reply
+   * @param reply Reply
+   * @return Attributes
+   */
+  Attributes decode_attrs(Reply &reply);
+
+  /** @brief Decode a single-name @ref SSH_FXP_NAME reply
+   * @param reply Reply
+   * @return Name
+   */
+  std::string decode_name(Reply &reply);
+
+  /** @brief Decode the reply to a @c check-file-name request
+   * @param reply Reply
+   * @return Digest in hex, or an empty string if it is not SHA-256
+   */
+  std::string decode_check_file(Reply &reply);
+
+  /** @brief Decode a multi-name @ref SSH_FXP_NAME reply
+   * @param reply Reply
+   * @return Names, or an empty vector at EOF
    */
-  uint32_t newid();
+  std::vector<Name> decode_names(Reply &reply);
+
+  /** @brief Decode a @ref SSH_FXP_DATA reply
+   * @param reply Reply
+   * @return Data, or an empty buffer at EOF
+   */
+  Buffer decode_data(Reply &reply);
 
   /** @brief Append a uint32
    * @param s Packet being constructed
@@ -216,9 +836,161 @@ private:
 
   /** @brief Send a packet
    * @param s Complete packet
+   *
+   * Any queued packets are sent first. The contents of @p s are consumed.
    */
   void send(std::string &s);
 
+  /** @brief Send a packet
+   * @param s Complete packet
+   * @return @c false if the request cannot be sent, see @ref prepare
+   *
+   * As @ref send, but must be called with @c output_lock held. If the
+   * request cannot be sent then @p s is left intact.
+   */
+  bool send_locked(std::string &s);
+
+  /** @brief Send a packet immediately
+   * @param s Complete packet
+   *
+   * The output queue is bypassed. This is used for the exchanges that start
+   * a session, when nothing else can be sending.
+   */
+  void send_now(std::string &s);
+
+  /** @brief Keep a copy of a request to send again after a reconnect
+   * @param packet Complete request packet, with the caller's handle
+   *
+   * Reads are recorded by @ref enqueue_read instead.
+   *
+   * Must be called with @c output_lock held.
+   */
+  void keep(const std::string &packet);
+
+  /** @brief Prepare a request for transmission
+   * @param packet Complete request packet
+   * @return @c false if the request refers to a file that could not be
+   * reopened after a reconnect
+   *
+   * If the request refers to a file handle which has changed since a
+   * reconnect, the current handle is substituted.
+   *
+   * Must be called with @c output_lock held.
+   */
+  bool prepare(std::string &packet);
+
+  /** @brief Complete a request that cannot be sent
+   * @param id Request ID
+   * @param type Request type
+   *
+   * Must be called without @c output_lock held.
+   */
+  void unsendable(uint32_t id, uint8_t type);
+
+  /** @brief Test whether a request type has a handle after its ID
+   * @param type Request type
+   * @return @c true if the request refers to a handle
+   */
+  static bool has_handle(uint8_t type);
+
+  /** @brief Replace the handle in a request packet
+   * @param packet Request packet
+   * @param handle New handle
+   */
+  void rehandle(std::string &packet, const std::string &handle);
+
+  /** @brief Lock guarding @c wfd, the output queue and open files */
+  std::mutex output_lock;
+
+  /** @brief What a file looked like when it was opened */
+  struct Identity {
+    /** @brief Set once @c size and @c mtime are known */
+    bool known = false;
+
+    /** @brief File size */
+    uint64_t size = 0;
+
+    /** @brief Modification time */
+    uint32_t mtime = 0;
+  };
+
+  /** @brief A file or directory opened on the server */
+  struct OpenFile {
+    /** @brief Absolute path */
+    std::string path;
+
+    /** @brief @c true for a directory */
+    bool directory = false;
+
+    /** @brief Open mode */
+    uint32_t mode = 0;
+
+    /** @brief Handle used by the server
+     *
+     * This is empty if the file could not be reopened after a reconnect.
+     */
+    std::string server;
+
+    /** @brief What the file looked like when it was first opened
+     *
+     * This is used to check that a file reopened after a reconnect is the
+     * same one. It is filled in by a @ref SSH_FXP_STAT sent after the
+     * @ref SSH_FXP_OPEN.
+     */
+    std::shared_ptr<Identity> identity;
+  };
+
+  /** @brief Open files and directories, indexed by caller's handle
+   *
+   * This is only maintained if reconnection is enabled.
+   */
+  std::map<std::string, OpenFile> files;
+
+  /** @brief Number of @c files whose server handle is not the caller's */
+  size_t aliased = 0;
+
+  /** @brief Used to make up distinct handles */
+  unsigned long serial = 0;
+
+  /** @brief Queued packets
+   *
+   * Only the first @c npending elements are live. Elements are re-used
+   * so that queuing does not normally allocate memory.
+   */
+  std::vector<std::string> pending;
+
+  /** @brief Number of queued packets */
+  size_t npending = 0;
+
+  /** @brief Set while a reconnect is in progress
+   *
+   * Meanwhile the reconnect owns @c rfd, @c wfd, @c pid and the output
+   * queue; requests are recorded in their slots but not queued, and are
+   * sent by @ref finish.
+   */
+  bool reconnecting = false;
+
+  /** @brief Files reopened by @ref reconnect, with their new handles
+   *
+   * A file that could not be reopened has an empty server handle.
+   */
+  std::vector<std::pair<std::string, OpenFile>> reopened;
+
+  /** @brief Scratch space for @ref flush */
+  std::vector<struct iovec> iov;
+
+  /** @brief Return the next free queue element
+   *
+   * Must be called with @c output_lock held.
+   */
+  std::string &next_pending();
+
+  /** @brief Send all queued packets
+   *
+   * Must be called with @c output_lock held.
+   */
+  void flush_locked();
+
   /** @brief Wait for a reply packet
    * @param id Packet ID
    * @param body Reply body (excluding type and length)
@@ -235,8 +1007,11 @@ private:
    *
    * If the type is @ref SSH_FXP_STATUS then @ref error can be used
    * to parse it.
+   *
+   * If the type is @ref SSH_FXP_DATA then @p body contains only the ID and
+   * the data is returned via @p data instead (see @ref recv_reply).
    */
-  int await_reply(uint32_t id, std::string &body);
+  int await_reply(uint32_t id, std::string &body, Buffer *data = nullptr);
 
   /** @brief Unpack a uint32
    * @param s Packet being parsed
@@ -267,52 +1042,286 @@ private:
    */
   void error(const std::string &body, const std::string &context = "");
 
+  /** @brief Record a newly opened file or directory
+   * @param server Handle returned by the server
+   * @param path Absolute path
+   * @param directory @c true for a directory
+   * @param mode Open mode
+   * @param identity What the file looked like when it was opened
+   * @return Handle to return to the caller
+   *
+   * Usually the caller's handle is the same as the server's, but after a
+   * reconnect the server may return a handle that callers already use for
+   * another file; in that case a distinct handle is made up.
+   */
+  std::string opened(const std::string &server, const std::string &path,
+                     bool directory, uint32_t mode = 0,
+                     std::shared_ptr<Identity> identity = nullptr);
+
+  /** @brief Find out what a newly opened file looks like
+   * @param handle Caller's handle
+   * @param identity Filled in when the reply arrives
+   *
+   * The identity is left unknown if the server can't report it.
+   */
+  void identify(const std::string &handle,
+                std::shared_ptr<Identity> identity);
+
+  /** @brief Forget a file or directory that is being closed
+   * @param handle Caller's handle
+   */
+  void forget(const std::string &handle);
+
+  /** @brief Called when the server has gone away
+   * @param why Error message
+   * @return @c true if the connection was, or is being, re-established
+   *
+   * If reconnection is not possible, the connection is marked as failed
+   * with @ref fail.
+   *
+   * In the event loop thread this returns at once; the reconnect happens in
+   * @c reconnector and its outcome is posted back to the loop.
+   */
+  bool lost(std::string why);
+
+  /** @brief Try to re-establish the connection
+   * @param why Error message, updated after each failed attempt
+   * @return @c true on success
+   */
+  bool retry(std::string &why);
+
+  /** @brief Re-establish the connection
+   *
+   * Starts a new session and reopens files, recording the new handles in
+   * @c reopened. A file whose size or modification time has changed since
+   * it was first opened is not reopened. Raises an exception on failure.
+   */
+  void reconnect();
+
+  /** @brief Complete a reconnect
+   * @param ok @c true if the connection was re-established
+   * @param why Error message if it was not
+   *
+   * Updates the open files and resends outstanding requests. Requests that
+   * cannot be resent are completed with an error.
+   */
+  void finish(bool ok, const std::string &why);
+
+  /** @brief Complete a request with a made-up status
+   * @param id Request ID
+   * @param status Status code
+   * @param message Error message
+   */
+  void synthesize(uint32_t id, uint32_t status, const std::string &message);
+
+  /** @brief Scheduler for reads (has its own lock) */
+  Scheduler read_scheduler;
+
   /** @brief Lock guarding all later fields */
   std::mutex lock;
 
-  /** @brief Condition variable signalling changes to state */
+  /** @brief Condition variable signalling the poll thread */
   std::condition_variable cond;
 
   /** @brief Set to terminate the poll thread */
   bool poll_quit = false;
 
-  /** @brief Next ID to use */
-  uint32_t nextid = 0;
+  /** @brief Error message if the poll thread has failed */
+  std::string failure;
+
+  /** @brief Reconnect attempts since the server last replied */
+  unsigned reconnects = 0;
+
+  /** @brief Number of bits of ID used to index @c slots */
+  static const unsigned SLOT_BITS = 16;
+
+  /** @brief Initial size of @c slots */
+  static const size_t INITIAL_SLOTS = 64;
 
-  /** @brief A stashed reply */
-  struct reply {
-    /** @brief Packet type */
-    int type;
-    /** @brief Packet body */
+  /** @brief State of an ID */
+  struct Slot {
+    /** @brief Possible states */
+    enum State {
+      /** @brief Available for allocation */
+      FREE,
+      /** @brief Waiting for a reply */
+      WAITING,
+      /** @brief Reply received but not yet consumed */
+      DONE,
+    };
+
+    /** @brief Current state */
+    State state = FREE;
+
+    /** @brief Full ID currently assigned to this slot */
+    uint32_t id = 0;
+
+    /** @brief Reply packet type */
+    int type = 0;
+
+    /** @brief Reply packet body */
     std::string body;
+
+    /** @brief Payload of a @ref SSH_FXP_DATA reply */
+    Buffer data;
+
+    /** @brief Signalled when the reply arrives */
+    std::condition_variable cond;
+
+    /** @brief Function to call when the reply arrives */
+    Completion completion;
+
+    /** @brief Type of the request kept to resend after a reconnect
+     *
+     * This is 0 if the request has not been sent yet, or if reconnection is
+     * disabled. The request fields are protected by @c output_lock rather
+     * than @c lock.
+     */
+    uint8_t request_type = 0;
+
+    /** @brief Request packet, with the caller's handle
+     *
+     * Reads are not copied; the fields below are enough to rebuild them.
+     */
+    std::string request;
+
+    /** @brief Caller's handle for a read */
+    std::string read_handle;
+
+    /** @brief Offset for a read */
+    uint64_t read_offset = 0;
+
+    /** @brief Length for a read */
+    uint32_t read_len = 0;
   };
 
-  /** @brief Replies recieved but not yet consumed */
-  std::map<uint32_t, reply> replies;
+  /** @brief Slots indexed by the low bits of the ID
+   *
+   * Slots are never moved once created, so a waiter can safely hold a
+   * pointer to one while the table grows.
+   */
+  std::vector<std::unique_ptr<Slot>> slots;
+
+  /** @brief Indexes of free slots */
+  std::vector<uint32_t> free_slots;
+
+  /** @brief Number of IDs waiting for a reply */
+  size_t outstanding = 0;
+
+  /** @brief Signalled when a slot is freed and the table is full */
+  std::condition_variable slot_freed;
 
-  /** @brief IDs outstanding */
-  std::set<uint32_t> waiting;
+  /** @brief Find the slot for an ID
+   * @param id ID
+   * @return Slot pointer or @c nullptr if @p id is not allocated
+   *
+   * Must be called with @c lock held.
+   */
+  Slot *find_slot(uint32_t id);
+
+  /** @brief Release a slot
+   * @param slot Slot to release
+   *
+   * Must be called with @c lock held.
+   */
+  void free_slot(Slot *slot);
 
   /** @brief Read bytes
    * @param buffer Buffer for bytes
    * @param n Bytes to read
+   *
+   * Large reads bypass @c input.
    * */
   void recv(char *buffer, size_t n);
 
   /** @brief Read a raw reply
    * @param reply Reply body
+   * @param data Where to store the payload of a @ref SSH_FXP_DATA reply
    * @return Packet type
+   *
+   * If @p data is not a null pointer and the reply has type @ref
+   * SSH_FXP_DATA then only the ID is stored in @p reply, and the data
+   * payload is read straight into @p data.
    */
-  int recv_reply(std::string &reply);
+  int recv_reply(std::string &reply, Buffer *data = nullptr);
 
   /** @brief Poll thread
    * @param self Connection object
    */
   static void poll(SFTP::Connection *self);
 
+  /** @brief Deliver a reply to its waiter or completion
+   * @param type Reply type
+   * @param body Reply body, starting with the ID
+   * @param data Payload of a @ref SSH_FXP_DATA reply
+   * @param synthetic @c true if the reply did not come from the server
+   *
+   * The contents of @p body and @p data are consumed.
+   */
+  void deliver(int type, std::string &body, Buffer &data,
+               bool synthetic = false);
+
+  /** @brief Mark the connection as failed
+   * @param why Error message
+   *
+   * Anything waiting for a reply is woken, and completions are called with
+   * the error.
+   */
+  void fail(const std::string &why);
+
+  /** @brief Attach the connection to the event loop
+   *
+   * Makes the file descriptors non-blocking and watches @c rfd.
+   */
+  void attach();
+
+  /** @brief Called by the event loop when @c rfd is readable */
+  void readable();
+
+  /** @brief Called by the event loop when @c wfd is writable */
+  void writable();
+
+  /** @brief Parse a reply from @c rx
+   * @return @c true if progress was made, @c false if more input is needed
+   */
+  bool parse_input();
+
+  /** @brief Input buffer for the event loop
+   *
+   * Only bytes from @c rx_start to @c rx_end are live.
+   */
+  std::vector<char> rx;
+
+  /** @brief Start of unconsumed input in @c rx */
+  size_t rx_start = 0;
+
+  /** @brief End of input in @c rx */
+  size_t rx_end = 0;
+
+  /** @brief Bytes of input needed to make progress */
+  size_t rx_need = 0;
+
+  /** @brief ID of a @ref SSH_FXP_DATA reply being received */
+  std::string rx_body;
+
+  /** @brief Payload of a @ref SSH_FXP_DATA reply being received */
+  Buffer rx_data;
+
+  /** @brief Bytes of @c rx_data received so far */
+  size_t rx_fill = 0;
+
+  /** @brief Set when waiting for @c wfd to become writable
+   *
+   * Protected by @c output_lock.
+   */
+  bool write_blocked = false;
+
   /** @brief Thread ID for poll thread */
   std::thread poller;
 
+  /** @brief Thread for reconnecting in event loop mode */
+  std::thread reconnector;
+
   friend class Attributes;
 };
 
@@ -361,6 +1370,18 @@ private:
   friend class Connection;
 };
 
+/** @brief A directory entry */
+struct Name {
+  /** @brief Filename */
+  std::string filename;
+
+  /** @brief Long description, in the style of <tt>ls -l</tt> */
+  std::string longname;
+
+  /** @brief File attributes */
+  Attributes attrs;
+};
+
 /** @brief Exception representing an SFTP error */
 class Error : public std::runtime_error {
 public:
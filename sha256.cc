@@ -0,0 +1,135 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sha256.h"
+#include <algorithm>
+#include <cstring>
+
+/** @brief Round constants */
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** @brief Rotate right
+ * @param x Value to rotate
+ * @param n Number of bits to rotate by
+ * @return Rotated value
+ */
+static inline uint32_t ror(uint32_t x, unsigned n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(h, initial, sizeof h);
+}
+
+void Sha256::update(const void *data, size_t n) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  length += n;
+  // Top up a partial block first
+  if(used) {
+    size_t take = std::min(n, sizeof block - used);
+    memcpy(block + used, p, take);
+    used += take;
+    p += take;
+    n -= take;
+    if(used < sizeof block)
+      return;
+    compress(block);
+    used = 0;
+  }
+  // Whole blocks are processed in place
+  while(n >= sizeof block) {
+    compress(p);
+    p += sizeof block;
+    n -= sizeof block;
+  }
+  memcpy(block, p, n);
+  used = n;
+}
+
+std::string Sha256::finish() {
+  uint64_t bits = length * 8;
+  // Pad with a 1 bit, then 0s up to the length field
+  block[used++] = 0x80;
+  if(used > sizeof block - 8) {
+    memset(block + used, 0, sizeof block - used);
+    compress(block);
+    used = 0;
+  }
+  memset(block + used, 0, sizeof block - 8 - used);
+  for(int i = 0; i < 8; ++i)
+    block[63 - i] = static_cast<uint8_t>(bits >> (8 * i));
+  compress(block);
+  used = 0;
+  static const char hexdigits[] = "0123456789abcdef";
+  std::string digest;
+  for(uint32_t word : h)
+    for(int shift = 28; shift >= 0; shift -= 4)
+      digest += hexdigits[(word >> shift) & 15];
+  return digest;
+}
+
+void Sha256::compress(const uint8_t *p) {
+  uint32_t w[64];
+  for(int i = 0; i < 16; ++i)
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+           | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  for(int i = 16; i < 64; ++i) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+  for(int i = 0; i < 64; ++i) {
+    uint32_t t1 = k + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25))
+                  + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22))
+                  + ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SHA256_H
+#define SHA256_H
+/** @file sha256.h
+ * @brief SHA-256 message digest
+ */
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/** @brief Incremental SHA-256 computation
+ *
+ * This follows FIPS 180-4. It is used to recognize identical files, so
+ * that their contents need not be compared.
+ */
+class Sha256 {
+public:
+  /** @brief Size of a digest in bytes */
+  static const size_t SIZE = 32;
+
+  /** @brief Start a new digest */
+  Sha256();
+
+  /** @brief Add data to the digest
+   * @param data Data to add
+   * @param n Number of bytes to add
+   */
+  void update(const void *data, size_t n);
+
+  /** @brief Complete the digest
+   * @return Digest in lower-case hex, as printed by @c sha256sum
+   *
+   * No more data may be added afterwards.
+   */
+  std::string finish();
+
+private:
+  /** @brief Chaining state */
+  uint32_t h[8];
+
+  /** @brief Partial block */
+  uint8_t block[64];
+
+  /** @brief Bytes in @ref block */
+  size_t used = 0;
+
+  /** @brief Total bytes added */
+  uint64_t length = 0;
+
+  /** @brief Process a complete block
+   * @param p Block to process
+   */
+  void compress(const uint8_t *p);
+};
+
+#endif
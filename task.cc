@@ -0,0 +1,152 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "task.h"
+#if HAVE_COROUTINES
+
+namespace {
+
+/** @brief A coroutine that runs to completion without being awaited */
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+/** @brief Run a task, reporting completion via a promise
+ * @param task Task to run
+ * @param done Promise to fulfil
+ */
+Detached run(std::shared_ptr<Coro::Task<void>> task,
+             std::shared_ptr<std::promise<void>> done) {
+  try {
+    co_await std::move(*task);
+    done->set_value();
+  } catch(...) {
+    done->set_exception(std::current_exception());
+  }
+}
+
+/** @brief Find the event loop for a connection
+ * @param conn Connection
+ * @return Event loop
+ */
+EventLoop *loop_for(SFTP::Connection &conn) {
+  EventLoop *loop = conn.event_loop();
+  if(!loop)
+    throw std::logic_error("coroutine operation without an event loop");
+  return loop;
+}
+
+} // namespace
+
+void Coro::Writable::await_suspend(std::coroutine_handle<> awaiter) {
+  EventLoop *l = loop;
+  int f = fd;
+  loop->watch(fd, EventLoop::WRITE, [l, f, awaiter](unsigned) {
+    l->unwatch(f);
+    awaiter.resume();
+  });
+}
+
+std::future<void> Coro::spawn(EventLoop *loop, Task<void> task) {
+  std::shared_ptr<Task<void>> t = std::make_shared<Task<void>>(std::move(task));
+  std::shared_ptr<std::promise<void>> done =
+    std::make_shared<std::promise<void>>();
+  std::future<void> f = done->get_future();
+  loop->post([t, done]() { run(t, done); });
+  return f;
+}
+
+Coro::Op<std::string> Coro::open(SFTP::Connection &conn,
+                                 const std::string &path, uint32_t mode) {
+  return Op<std::string>(loop_for(conn),
+                         [&](const SFTP::Connection::Notify &n) {
+                           return conn.open_async(path, mode, n);
+                         });
+}
+
+Coro::Op<void> Coro::close(SFTP::Connection &conn, const std::string &handle) {
+  return Op<void>(loop_for(conn), [&](const SFTP::Connection::Notify &n) {
+    return conn.close_async(handle, n);
+  });
+}
+
+Coro::Op<SFTP::Attributes> Coro::fstat(SFTP::Connection &conn,
+                                       const std::string &handle) {
+  return Op<SFTP::Attributes>(loop_for(conn),
+                              [&](const SFTP::Connection::Notify &n) {
+                                return conn.fstat_async(handle, n);
+                              });
+}
+
+Coro::Op<SFTP::Attributes> Coro::stat(SFTP::Connection &conn,
+                                      const std::string &path) {
+  return Op<SFTP::Attributes>(loop_for(conn),
+                              [&](const SFTP::Connection::Notify &n) {
+                                return conn.stat_async(path, n);
+                              });
+}
+
+Coro::Op<std::string> Coro::opendir(SFTP::Connection &conn,
+                                    const std::string &path) {
+  return Op<std::string>(loop_for(conn),
+                         [&](const SFTP::Connection::Notify &n) {
+                           return conn.opendir_async(path, n);
+                         });
+}
+
+Coro::Op<std::vector<SFTP::Name>> Coro::readdir(SFTP::Connection &conn,
+                                                const std::string &handle) {
+  return Op<std::vector<SFTP::Name>>(loop_for(conn),
+                                     [&](const SFTP::Connection::Notify &n) {
+                                       return conn.readdir_async(handle, n);
+                                     });
+}
+
+Coro::Op<Buffer> Coro::read(SFTP::Connection &conn,
+                            const SFTP::Connection::ReadTemplate &t,
+                            uint64_t offset, uint32_t len, uint32_t &id) {
+  return Op<Buffer>(loop_for(conn), [&](const SFTP::Connection::Notify &n) {
+    std::shared_ptr<std::promise<Buffer>> promise =
+      std::make_shared<std::promise<Buffer>>();
+    std::future<Buffer> f = promise->get_future();
+    id = conn.queue_read(
+      t, offset, len, [promise, n](Buffer &data, std::exception_ptr failure) {
+        if(failure)
+          promise->set_exception(failure);
+        else
+          promise->set_value(std::move(data));
+        n();
+      });
+    return f;
+  });
+}
+
+#endif
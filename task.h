@@ -0,0 +1,366 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TASK_H
+#define TASK_H
+/** @file task.h
+ * @brief Coroutine tasks for SFTP operations
+ *
+ * This is only available when configured with @c --enable-coroutines.
+ *
+ * A @ref Coro::Task is a lazily started coroutine. Tasks can @c co_await
+ * each other, SFTP operations (see @ref Coro::open and friends) and
+ * writable file descriptors. Top-level tasks are started with @ref
+ * Coro::spawn.
+ *
+ * All tasks run in the @ref EventLoop thread of the connections they use.
+ */
+
+#include <config.h>
+#if HAVE_COROUTINES
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "eventloop.h"
+#include "sftp.h"
+
+namespace Coro {
+
+/** @brief Common part of task promises */
+struct PromiseBase {
+  /** @brief Coroutine to resume when the task finishes */
+  std::coroutine_handle<> continuation;
+
+  /** @brief Exception raised by the task */
+  std::exception_ptr error;
+
+  /** @brief Tasks don't start until awaited */
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+
+  /** @brief Awaiter that transfers control to the continuation */
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> h) noexcept {
+      if(h.promise().continuation)
+        return h.promise().continuation;
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  /** @brief Resume the continuation when the task finishes */
+  FinalAwaiter final_suspend() noexcept {
+    return {};
+  }
+
+  /** @brief Capture an exception raised by the task */
+  void unhandled_exception() {
+    error = std::current_exception();
+  }
+};
+
+/** @brief Result storage for a task promise */
+template <typename T>
+struct PromiseResult : PromiseBase {
+  /** @brief Value returned by the task */
+  std::optional<T> value;
+
+  /** @brief Store the value returned by the task */
+  void return_value(T v) {
+    value = std::move(v);
+  }
+
+  /** @brief Return the task's result */
+  T result() {
+    if(error)
+      std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+/** @brief Result storage for a task promise with no value */
+template <>
+struct PromiseResult<void> : PromiseBase {
+  /** @brief Called when the task returns */
+  void return_void() {}
+
+  /** @brief Raise the task's exception, if any */
+  void result() {
+    if(error)
+      std::rethrow_exception(error);
+  }
+};
+
+/** @brief A coroutine returning @p T
+ *
+ * The coroutine starts when the task is awaited, and the awaiter resumes
+ * when it finishes.
+ */
+template <typename T>
+class Task {
+public:
+  /** @brief Promise type */
+  struct promise_type : PromiseResult<T> {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  /** @brief Move constructor
+   * @param other Task to take over
+   */
+  Task(Task &&other) noexcept :
+    handle(std::exchange(other.handle, nullptr)) {}
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  /** @brief Destroy a task */
+  ~Task() {
+    if(handle)
+      handle.destroy();
+  }
+
+  /** @brief Tasks are never ready before they are awaited */
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  /** @brief Start the task
+   * @param awaiter Coroutine to resume when it finishes
+   * @return Task to transfer control to
+   */
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<> awaiter) noexcept {
+    handle.promise().continuation = awaiter;
+    return handle;
+  }
+
+  /** @brief Return the task's result */
+  T await_resume() {
+    return handle.promise().result();
+  }
+
+private:
+  /** @brief Construct a task from its coroutine
+   * @param h Coroutine handle
+   */
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+  /** @brief Coroutine handle */
+  std::coroutine_handle<promise_type> handle;
+};
+
+/** @brief An asynchronous operation that can be awaited
+ *
+ * The operation starts as soon as the @c Op is constructed, so several may
+ * be in flight at once; awaiting one suspends the caller until it
+ * completes. The awaiting coroutine is resumed in the event loop thread.
+ */
+template <typename T>
+class Op {
+public:
+  /** @brief Function that starts an operation
+   *
+   * It is passed a notification to call when the returned future becomes
+   * ready.
+   */
+  typedef std::function<std::future<T>(const SFTP::Connection::Notify &)>
+    Starter;
+
+  /** @brief Start an operation
+   * @param loop Event loop in which to resume the awaiter
+   * @param start Function to start the operation
+   */
+  Op(EventLoop *loop, const Starter &start) :
+    state(std::make_shared<State>()) {
+    state->loop = loop;
+    std::shared_ptr<State> s = state;
+    state->future = start([s]() { s->ready(); });
+  }
+
+  /** @brief Test whether the operation has completed */
+  bool await_ready() const {
+    std::lock_guard<std::mutex> g(state->lock);
+    return state->done;
+  }
+
+  /** @brief Wait for the operation to complete
+   * @param awaiter Coroutine to resume
+   * @return @c false if the operation has already completed
+   */
+  bool await_suspend(std::coroutine_handle<> awaiter) {
+    std::lock_guard<std::mutex> g(state->lock);
+    if(state->done)
+      return false;
+    state->waiter = awaiter;
+    return true;
+  }
+
+  /** @brief Return the operation's result */
+  T await_resume() {
+    return state->future.get();
+  }
+
+private:
+  /** @brief State shared with the completion */
+  struct State {
+    /** @brief Lock protecting @c done and @c waiter */
+    std::mutex lock;
+
+    /** @brief Set when the future is ready */
+    bool done = false;
+
+    /** @brief Coroutine waiting for the result */
+    std::coroutine_handle<> waiter;
+
+    /** @brief Event loop to resume the waiter in */
+    EventLoop *loop = nullptr;
+
+    /** @brief Future for the result */
+    std::future<T> future;
+
+    /** @brief Called when the future becomes ready */
+    void ready() {
+      std::lock_guard<std::mutex> g(lock);
+      done = true;
+      if(waiter) {
+        std::coroutine_handle<> h = waiter;
+        loop->post([h]() { h.resume(); });
+      }
+    }
+  };
+
+  /** @brief Shared state */
+  std::shared_ptr<State> state;
+};
+
+/** @brief Awaiter for a file descriptor to become writable */
+class Writable {
+public:
+  /** @brief Construct an awaiter
+   * @param loop Event loop
+   * @param fd File descriptor
+   */
+  Writable(EventLoop *loop, int fd) : loop(loop), fd(fd) {}
+
+  /** @brief Always wait */
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  /** @brief Wait for @c fd to become writable
+   * @param awaiter Coroutine to resume
+   */
+  void await_suspend(std::coroutine_handle<> awaiter);
+
+  /** @brief Nothing to return */
+  void await_resume() const noexcept {}
+
+private:
+  /** @brief Event loop */
+  EventLoop *loop;
+
+  /** @brief File descriptor */
+  int fd;
+};
+
+/** @brief Run a task in an event loop
+ * @param loop Event loop
+ * @param task Task to run
+ * @return Future that becomes ready when the task finishes
+ */
+std::future<void> spawn(EventLoop *loop, Task<void> task);
+
+/** @brief Open a remote file
+ * @param conn Connection attached to an event loop
+ * @param path Remote filename
+ * @param mode Open mode
+ * @return Operation yielding the handle
+ */
+Op<std::string> open(SFTP::Connection &conn, const std::string &path,
+                     uint32_t mode);
+
+/** @brief Close a remote file or directory
+ * @param conn Connection attached to an event loop
+ * @param handle Handle
+ * @return Operation
+ */
+Op<void> close(SFTP::Connection &conn, const std::string &handle);
+
+/** @brief Get remote file information
+ * @param conn Connection attached to an event loop
+ * @param handle Handle
+ * @return Operation yielding the attributes
+ */
+Op<SFTP::Attributes> fstat(SFTP::Connection &conn, const std::string &handle);
+
+/** @brief Get remote file information by name
+ * @param conn Connection attached to an event loop
+ * @param path Remote filename
+ * @return Operation yielding the attributes
+ */
+Op<SFTP::Attributes> stat(SFTP::Connection &conn, const std::string &path);
+
+/** @brief Open a remote directory
+ * @param conn Connection attached to an event loop
+ * @param path Remote directory name
+ * @return Operation yielding the handle
+ */
+Op<std::string> opendir(SFTP::Connection &conn, const std::string &path);
+
+/** @brief Read directory entries
+ * @param conn Connection attached to an event loop
+ * @param handle Handle from @ref opendir
+ * @return Operation yielding some entries, or none at the end
+ */
+Op<std::vector<SFTP::Name>> readdir(SFTP::Connection &conn,
+                                    const std::string &handle);
+
+/** @brief Read from a remote file
+ * @param conn Connection attached to an event loop
+ * @param t Template for the handle to read from
+ * @param offset Offset within file
+ * @param len Length to read
+ * @param id Where to store the request ID, for SFTP::Connection::abandon
+ * @return Operation yielding the data, which is empty at EOF
+ *
+ * The read is queued; it is not sent until the next call to @ref
+ * SFTP::Connection::flush.
+ */
+Op<Buffer> read(SFTP::Connection &conn,
+                const SFTP::Connection::ReadTemplate &t, uint64_t offset,
+                uint32_t len, uint32_t &id);
+
+} // namespace Coro
+
+#endif
+#endif
@@ -0,0 +1,80 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "window.h"
+#include <algorithm>
+
+/** @brief How long a minimum RTT measurement remains valid */
+static const std::chrono::seconds rtt_lifetime(10);
+
+ReadWindow::ReadWindow(size_t floor_, size_t ceiling_) :
+  floor(floor_), ceiling(std::max(floor_, ceiling_)), window(floor_) {}
+
+void ReadWindow::sample(size_t bytes, clock::duration rtt) {
+  clock::time_point now = clock::now();
+  // Track the minimum RTT, but let old measurements expire in case the
+  // path has changed.
+  if(rtt <= min_rtt || now - min_rtt_stamp > rtt_lifetime) {
+    min_rtt = rtt;
+    min_rtt_stamp = now;
+  }
+  if(round_bytes == 0 && rounds == 0)
+    round_start = now;
+  round_bytes += bytes;
+  // A round lasts one RTT
+  if(now - round_start >= min_rtt)
+    end_round(now);
+  // In slow start, grow by the amount delivered
+  if(slow_start)
+    window = clamp((double)window + bytes);
+}
+
+void ReadWindow::end_round(clock::time_point now) {
+  double elapsed = std::chrono::duration<double>(now - round_start).count();
+  if(elapsed > 0) {
+    round_rates[rounds % ROUNDS] = round_bytes / elapsed;
+    ++rounds;
+    max_rate = *std::max_element(round_rates, round_rates + ROUNDS);
+  }
+  round_start = now;
+  round_bytes = 0;
+  if(slow_start) {
+    // Leave slow start when the rate has stopped growing by at least 25%
+    // for three rounds.
+    if(max_rate >= full_rate * 1.25) {
+      full_rate = max_rate;
+      full_count = 0;
+    } else if(++full_count >= 3)
+      slow_start = false;
+  }
+  if(!slow_start)
+    window = clamp(2 * max_rate * rtt());
+}
+
+double ReadWindow::rtt() const {
+  if(min_rtt == clock::duration::max())
+    return 0;
+  return std::chrono::duration<double>(min_rtt).count();
+}
+
+size_t ReadWindow::clamp(double proposed) const {
+  if(proposed < floor)
+    return floor;
+  if(proposed > ceiling)
+    return ceiling;
+  return proposed;
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of remdiff.
+ * Copyright © Richard Kettlewell
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WINDOW_H
+#define WINDOW_H
+/** @file window.h
+ * @brief Adaptive read window
+ */
+
+#include <config.h>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+/** @brief Adaptive sizing for a pipeline of reads
+ *
+ * The window is the number of bytes a reader should keep in flight. It
+ * starts at the floor and grows by the size of every completed read (slow
+ * start, doubling once per round trip). Once the delivered rate stops
+ * growing the window tracks twice the measured bandwidth-delay product,
+ * so it shrinks again if the link or the consumer slows down.
+ *
+ * The window is always kept between the floor and ceiling passed to the
+ * constructor.
+ */
+class ReadWindow {
+public:
+  /** @brief Clock used for measurements */
+  typedef std::chrono::steady_clock clock;
+
+  /** @brief Construct a read window
+   * @param floor Minimum window size in bytes
+   * @param ceiling Maximum window size in bytes
+   */
+  ReadWindow(size_t floor, size_t ceiling);
+
+  /** @brief Current window size in bytes */
+  size_t size() const {
+    return window;
+  }
+
+  /** @brief Largest size the window can reach in bytes */
+  size_t maximum() const {
+    return ceiling;
+  }
+
+  /** @brief Record a completed read
+   * @param bytes Bytes delivered by the read
+   * @param rtt Time between issuing the read and its completion
+   */
+  void sample(size_t bytes, clock::duration rtt);
+
+  /** @brief Return @c true while still in slow start */
+  bool starting() const {
+    return slow_start;
+  }
+
+  /** @brief Minimum observed round trip time in seconds */
+  double rtt() const;
+
+  /** @brief Maximum recently delivered rate in bytes/second */
+  double rate() const {
+    return max_rate;
+  }
+
+private:
+  /** @brief Number of rounds that the rate filter covers */
+  static const int ROUNDS = 8;
+
+  /** @brief Minimum window size */
+  size_t floor;
+
+  /** @brief Maximum window size */
+  size_t ceiling;
+
+  /** @brief Current window size */
+  size_t window;
+
+  /** @brief Set while in slow start */
+  bool slow_start = true;
+
+  /** @brief Minimum round trip time */
+  clock::duration min_rtt = clock::duration::max();
+
+  /** @brief When @ref min_rtt was last set */
+  clock::time_point min_rtt_stamp;
+
+  /** @brief Start of current measurement round */
+  clock::time_point round_start;
+
+  /** @brief Bytes delivered in current round */
+  uint64_t round_bytes = 0;
+
+  /** @brief Number of completed rounds */
+  unsigned rounds = 0;
+
+  /** @brief Delivered rate for recent rounds, in bytes/second */
+  double round_rates[ROUNDS] = {};
+
+  /** @brief Maximum of @ref round_rates */
+  double max_rate = 0;
+
+  /** @brief Rate at which slow start last saw significant growth */
+  double full_rate = 0;
+
+  /** @brief Rounds since the rate last grew significantly */
+  unsigned full_count = 0;
+
+  /** @brief Complete a measurement round
+   * @param now Current time
+   */
+  void end_round(clock::time_point now);
+
+  /** @brief Clamp a proposed window size to the floor and ceiling
+   * @param proposed Proposed size in bytes
+   * @return Acceptable size in bytes
+   */
+  size_t clamp(double proposed) const;
+};
+
+#endif